@@ -0,0 +1,340 @@
+/* contrib/pg_plan_watch/pg_plan_watch--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_plan_watch" to load this file. \quit
+
+-- Register functions.
+CREATE FUNCTION pg_plan_watch_stats(
+    OUT kind text,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT relid oid,
+    OUT funcid oid,
+    OUT plan_node_id integer,
+    OUT label text,
+    OUT calls bigint,
+    OUT counters float8[],
+    OUT last_seen timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_plan_watch_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_plan_watch_reset() FROM PUBLIC;
+
+-- Heap blocks read by flagged sequential scans, and the part of them that
+-- was spent on dead tuples.
+CREATE VIEW pg_plan_watch_bloat AS
+  SELECT dbid,
+         relid,
+         calls AS scans,
+         counters[1]::bigint AS blocks_scanned,
+         counters[2] AS wasted_blocks,
+         counters[3]::bigint AS rows_examined,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'seqscan_bloat';
+
+GRANT SELECT ON pg_plan_watch_bloat TO PUBLIC;
+
+CREATE FUNCTION pg_plan_watch_cost_calibration(
+    OUT spcid oid,
+    OUT samples bigint,
+    OUT seq_page_time float8,
+    OUT random_page_time float8,
+    OUT cpu_tuple_time float8,
+    OUT seq_page_cost float8,
+    OUT random_page_cost float8,
+    OUT random_page_cost_low float8,
+    OUT random_page_cost_high float8,
+    OUT cpu_tuple_cost float8,
+    OUT cpu_tuple_cost_low float8,
+    OUT cpu_tuple_cost_high float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Planner cost settings fitted from the scan timings of sampled queries,
+-- with 95% confidence intervals.  Times are in milliseconds per unit.
+CREATE VIEW pg_plan_watch_cost_calibration AS
+  SELECT t.spcname, c.*
+    FROM pg_plan_watch_cost_calibration() c
+         LEFT JOIN pg_tablespace t ON t.oid = c.spcid;
+
+GRANT SELECT ON pg_plan_watch_cost_calibration TO PUBLIC;
+
+-- Correlated SubPlans executed more than log_subplan_loops_threshold times.
+CREATE VIEW pg_plan_watch_subplans AS
+  SELECT dbid,
+         queryid,
+         plan_node_id,
+         calls,
+         counters[1]::bigint AS loops,
+         counters[2]::bigint AS rows_examined,
+         counters[3] AS total_time,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'subplan_loops';
+
+GRANT SELECT ON pg_plan_watch_subplans TO PUBLIC;
+
+-- Queries executed more than log_repeated_query_threshold times within a
+-- single transaction (or top-level statement, for nested executions).
+CREATE VIEW pg_plan_watch_repeated_queries AS
+  SELECT dbid,
+         queryid,
+         calls AS occurrences,
+         counters[1]::bigint AS executions,
+         counters[2] AS total_time,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'repeated_query';
+
+GRANT SELECT ON pg_plan_watch_repeated_queries TO PUBLIC;
+
+-- Queries sending more than log_result_rows_threshold rows or
+-- log_result_size_threshold to the client, per application_name.
+CREATE VIEW pg_plan_watch_large_results AS
+  SELECT dbid,
+         queryid,
+         label AS application_name,
+         calls,
+         counters[1]::bigint AS rows,
+         counters[2]::bigint AS bytes,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'large_result';
+
+GRANT SELECT ON pg_plan_watch_large_results TO PUBLIC;
+
+-- WAL generated by queries exceeding log_wal_threshold.  Rows with a NULL
+-- relid are statement totals; the others attribute WAL to the relation
+-- modified by each ModifyTable node.
+CREATE VIEW pg_plan_watch_wal AS
+  SELECT dbid,
+         queryid,
+         relid,
+         calls,
+         counters[1]::bigint AS wal_records,
+         counters[2]::bigint AS wal_fpi,
+         counters[3]::numeric AS wal_bytes,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'wal';
+
+GRANT SELECT ON pg_plan_watch_wal TO PUBLIC;
+
+-- Plan nodes whose own time per tuple exceeded log_tuple_cost_threshold.
+CREATE VIEW pg_plan_watch_tuple_costs AS
+  SELECT dbid,
+         queryid,
+         plan_node_id,
+         calls,
+         counters[1]::bigint AS tuples,
+         counters[2] AS self_time,
+         counters[2] * 1e6 / nullif(counters[1], 0) AS ns_per_tuple,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'tuple_cost';
+
+GRANT SELECT ON pg_plan_watch_tuple_costs TO PUBLIC;
+
+-- Append and MergeAppend nodes over partitioned tables that scanned more
+-- partitions than log_partitions_threshold or log_partitions_fraction.
+CREATE VIEW pg_plan_watch_partitions AS
+  SELECT dbid,
+         queryid,
+         relid,
+         calls,
+         counters[1] / calls AS avg_partitions_scanned,
+         counters[2] / calls AS avg_partitions,
+         counters[1] / nullif(counters[2], 0) AS fraction_scanned,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'partitions';
+
+GRANT SELECT ON pg_plan_watch_partitions TO PUBLIC;
+
+-- Memoize nodes whose hit ratio was below log_memoize_hit_ratio.
+CREATE VIEW pg_plan_watch_memoize AS
+  SELECT dbid,
+         queryid,
+         plan_node_id,
+         calls,
+         counters[1]::bigint AS hits,
+         counters[2]::bigint AS misses,
+         counters[1] / nullif(counters[1] + counters[2], 0) AS hit_ratio,
+         counters[3]::bigint AS evictions,
+         counters[4]::bigint AS overflows,
+         counters[5]::bigint AS max_peak_memory,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'memoize';
+
+GRANT SELECT ON pg_plan_watch_memoize TO PUBLIC;
+
+-- Recursive queries exceeding log_recursion_depth_threshold or
+-- log_recursion_rows_threshold.
+CREATE VIEW pg_plan_watch_recursion AS
+  SELECT dbid,
+         queryid,
+         plan_node_id,
+         calls,
+         counters[1] / calls AS avg_depth,
+         counters[3]::bigint AS max_depth,
+         counters[2]::bigint AS intermediate_rows,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'recursion';
+
+GRANT SELECT ON pg_plan_watch_recursion TO PUBLIC;
+
+-- Flagged sequential scans per top-level query, calling function and
+-- relation, with the share of the relation's flagged rows.
+-- Requires track_callers.
+CREATE VIEW pg_plan_watch_seqscan_callers AS
+  SELECT dbid,
+         queryid AS toplevel_queryid,
+         funcid,
+         relid,
+         calls AS statements,
+         counters[1]::bigint AS scans,
+         counters[2]::bigint AS rows_examined,
+         counters[3] AS total_time,
+         counters[2] / nullif(sum(counters[2])
+                              OVER (PARTITION BY dbid, relid), 0) AS rows_share,
+         last_seen
+    FROM pg_plan_watch_stats()
+   WHERE kind = 'seqscan_caller';
+
+GRANT SELECT ON pg_plan_watch_seqscan_callers TO PUBLIC;
+
+CREATE FUNCTION pg_plan_watch_node_stats(
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT planid bigint,
+    OUT plan_node_id integer,
+    OUT node text,
+    OUT executions bigint,
+    OUT flagged bigint,
+    OUT rows float8,
+    OUT max_rows float8,
+    OUT p95_rows float8,
+    OUT loops float8,
+    OUT timed_executions bigint,
+    OUT total_time float8,
+    OUT self_time float8,
+    OUT max_time float8,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT temp_blks bigint,
+    OUT last_capture timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Execution statistics of the plan nodes of sampled and captured queries,
+-- with each node's share of its plan's self time.
+CREATE VIEW pg_plan_watch_nodes AS
+  SELECT dbid,
+         queryid,
+         planid,
+         plan_node_id,
+         node,
+         executions,
+         flagged,
+         rows / executions AS mean_rows,
+         max_rows,
+         p95_rows,
+         loops / executions AS mean_loops,
+         total_time / nullif(timed_executions, 0) AS mean_time,
+         max_time,
+         self_time,
+         self_time / nullif(sum(self_time)
+                            OVER (PARTITION BY dbid, queryid, planid), 0) AS self_time_share,
+         shared_blks_hit,
+         shared_blks_read,
+         temp_blks,
+         last_capture
+    FROM pg_plan_watch_node_stats();
+
+GRANT SELECT ON pg_plan_watch_nodes TO PUBLIC;
+
+-- Folded stacks of sampled queries, for flame graphs, e.g.
+--   psql -Atc "SELECT folded FROM pg_plan_watch_folded_stacks()" | flamegraph.pl
+CREATE FUNCTION pg_plan_watch_folded_stacks(
+    OUT dbid oid,
+    OUT stack text,
+    OUT samples bigint,
+    OUT self_time float8,
+    OUT folded text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Datagrams sent to metrics_target, and those dropped because the socket
+-- was not ready.
+CREATE FUNCTION pg_plan_watch_metrics_sink(
+    OUT sent bigint,
+    OUT dropped bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Captured plans, written by the persister background worker when
+-- pg_plan_watch.persist_database names this database.  The worker adds a
+-- partition per day and drops those older than persist_retention days.
+CREATE TABLE pg_plan_watch_captures (
+    captured_at timestamp with time zone NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    queryid bigint,
+    duration float8,
+    plan text
+) PARTITION BY RANGE (captured_at);
+
+-- Captures waiting for the persister, and those dropped because its queue
+-- was full.
+CREATE FUNCTION pg_plan_watch_capture_queue(
+    OUT queued bigint,
+    OUT dropped bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- State of the capture file set by pg_plan_watch.capture_file.
+CREATE FUNCTION pg_plan_watch_capture_file(
+    OUT path text,
+    OUT slots int,
+    OUT next_seq bigint,
+    OUT skipped bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Write the captures of [from, to) and the per-node statistics into a
+-- columnar file on the server, for offline analysis.
+CREATE FUNCTION pg_plan_watch_export_columnar(
+    IN path text,
+    IN "from" timestamp with time zone,
+    IN "to" timestamp with time zone,
+    OUT captures bigint,
+    OUT nodes bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION pg_plan_watch_export_columnar(text, timestamp with time zone, timestamp with time zone) FROM PUBLIC;
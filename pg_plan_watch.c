@@ -10,17 +10,49 @@
 #include "postgres.h"
 
 #include <limits.h>
+#include <math.h>
 
 #include "access/parallel.h"
+#include "access/relation.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/explain_format.h"
 #include "commands/explain_state.h"
+#include "common/hashfn.h"
 #include "common/pg_prng.h"
 #include "executor/instrument.h"
+#include "funcapi.h"
+#include "lib/ilist.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
 #include "nodes/nodeFuncs.h"
 #include "parser/parsetree.h"
+#include "partitioning/partdesc.h"
+#include "pg_plan_watch.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "postmaster/bgworker.h"
+#include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/utility.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/regproc.h"
+#include "utils/rel.h"
+#include "utils/spccache.h"
+#include "utils/timestamp.h"
 
 PG_MODULE_MAGIC_EXT(
 					.name = "pg_plan_watch",
@@ -29,7 +61,23 @@ PG_MODULE_MAGIC_EXT(
 
 /* GUC variables */
 static int	pg_plan_watch_log_seqscan_threshold = -1;	/* tuples */
+static int	pg_plan_watch_log_subplan_loops_threshold = -1; /* loops */
+static int	pg_plan_watch_log_limit_wasted_rows = -1;	/* tuples */
+static int	pg_plan_watch_log_repeated_query_threshold = -1;	/* executions */
+static int	pg_plan_watch_log_result_rows_threshold = -1;	/* tuples */
+static int	pg_plan_watch_log_result_size_threshold = -1;	/* kB */
+static int	pg_plan_watch_log_wal_threshold = -1;	/* kB */
+static int	pg_plan_watch_log_first_row_threshold = -1; /* msec */
+static int	pg_plan_watch_log_tuple_cost_threshold = -1;	/* nsec */
+static int	pg_plan_watch_log_partitions_threshold = -1;	/* partitions */
+static double pg_plan_watch_log_partitions_fraction = -1;
+static double pg_plan_watch_log_memoize_hit_ratio = -1;
+static double pg_plan_watch_log_foreign_pass_ratio = -1;
+static int	pg_plan_watch_log_recursion_depth_threshold = -1; /* iterations */
+static int	pg_plan_watch_log_recursion_rows_threshold = -1;	/* tuples */
 static int	pg_plan_watch_log_parameter_max_length = -1; /* bytes or -1 */
+static int	pg_plan_watch_log_batch_size = -1;	/* kB */
+static int	pg_plan_watch_log_batch_max_age = 10000;	/* msec */
 static bool pg_plan_watch_log_analyze = false;
 static bool pg_plan_watch_log_verbose = false;
 static bool pg_plan_watch_log_buffers = false;
@@ -40,6 +88,22 @@ static bool pg_plan_watch_log_settings = false;
 static int	pg_plan_watch_log_format = EXPLAIN_FORMAT_TEXT;
 static int	pg_plan_watch_log_level = LOG;
 static bool pg_plan_watch_log_nested_statements = false;
+static bool pg_plan_watch_log_nested_summary = false;
+static bool pg_plan_watch_track_functions = false;
+static bool pg_plan_watch_track_callers = false;
+static int	pg_plan_watch_max_entries = 5000;
+int			pg_plan_watch_max_nodes = 10000;
+static int	pg_plan_watch_max_stacks = 5000;
+static double pg_plan_watch_sample_rate = 0;
+char	   *pg_plan_watch_otlp_target = NULL;
+char	   *pg_plan_watch_trace_context = NULL;
+char	   *pg_plan_watch_metrics_target = NULL;
+char	   *pg_plan_watch_persist_database = NULL;
+int			pg_plan_watch_persist_queue_size = 128;	/* captures */
+int			pg_plan_watch_persist_naptime = 1000;	/* msec */
+int			pg_plan_watch_persist_retention = 7;	/* days */
+char	   *pg_plan_watch_capture_file = NULL;
+int			pg_plan_watch_capture_file_slots = 1024;	/* records */
 
 static const struct config_enum_entry format_options[] = {
 	{"text", EXPLAIN_FORMAT_TEXT, false},
@@ -66,15 +130,344 @@ static const struct config_enum_entry loglevel_options[] = {
 /* Current nesting depth of ExecutorRun calls */
 static int	nesting_level = 0;
 
+/* Is the current top-level query to be sampled? */
+static bool current_query_sampled = false;
+
+/* Are function lookups being done for a query whose calls we track? */
+static bool function_tracking_active = false;
+
+/*
+ * User-defined functions currently executing, innermost last, as seen by
+ * pg_plan_watch_fmgr_hook.  Calls nested deeper than PW_MAX_CALLER_DEPTH
+ * are counted but not recorded.
+ */
+#define PW_MAX_CALLER_DEPTH	64
+
+static Oid	caller_stack[PW_MAX_CALLER_DEPTH];
+static int	caller_depth = 0;
+
+#define CurrentCaller() \
+	(caller_depth > 0 ? \
+	 caller_stack[Min(caller_depth, PW_MAX_CALLER_DEPTH) - 1] : InvalidOid)
+
+#define pg_plan_watch_detectors_enabled() \
+	(pg_plan_watch_log_seqscan_threshold >= 0 || \
+	 pg_plan_watch_log_subplan_loops_threshold >= 0 || \
+	 pg_plan_watch_log_limit_wasted_rows >= 0 || \
+	 pg_plan_watch_log_result_rows_threshold >= 0 || \
+	 pg_plan_watch_log_result_size_threshold >= 0 || \
+	 pg_plan_watch_log_wal_threshold >= 0 || \
+	 pg_plan_watch_log_first_row_threshold >= 0 || \
+	 pg_plan_watch_log_tuple_cost_threshold >= 0 || \
+	 pg_plan_watch_log_partitions_threshold >= 0 || \
+	 pg_plan_watch_log_partitions_fraction >= 0 || \
+	 pg_plan_watch_log_memoize_hit_ratio >= 0 || \
+	 pg_plan_watch_log_foreign_pass_ratio >= 0 || \
+	 pg_plan_watch_log_recursion_depth_threshold >= 0 || \
+	 pg_plan_watch_log_recursion_rows_threshold >= 0)
+
+/* The persisting worker's own statements are never watched */
 #define pg_plan_watch_enabled() \
-	(pg_plan_watch_log_seqscan_threshold >= 0 && \
-	 (nesting_level == 0 || pg_plan_watch_log_nested_statements))
+	((pg_plan_watch_detectors_enabled() || pg_plan_watch_sample_rate > 0) && \
+	 (nesting_level == 0 || pg_plan_watch_log_nested_statements) && \
+	 !am_persist_worker)
+
+/*
+ * Shared-memory statistics.
+ *
+ * Detectors accumulate what they find into a single hash table, keyed by the
+ * kind of finding and the objects it concerns.  Each kind gives its own
+ * meaning to the counters[] array; the views in pg_plan_watch--1.0.sql put
+ * names on them.
+ */
+#define PWS_NUM_COUNTERS	6
+
+typedef enum pwsKind
+{
+	PWS_KIND_SEQSCAN_BLOAT,
+	PWS_KIND_SUBPLAN,
+	PWS_KIND_REPEATED_QUERY,
+	PWS_KIND_LARGE_RESULT,
+	PWS_KIND_WAL,
+	PWS_KIND_TUPLE_COST,
+	PWS_KIND_PARTITIONS,
+	PWS_KIND_MEMOIZE,
+	PWS_KIND_RECURSION,
+	PWS_KIND_SEQSCAN_CALLER,
+} pwsKind;
+
+#define PWS_NUM_KINDS	(PWS_KIND_SEQSCAN_CALLER + 1)
+
+static const char *const pwsKindNames[PWS_NUM_KINDS] = {
+	[PWS_KIND_SEQSCAN_BLOAT] = "seqscan_bloat",
+	[PWS_KIND_SUBPLAN] = "subplan_loops",
+	[PWS_KIND_REPEATED_QUERY] = "repeated_query",
+	[PWS_KIND_LARGE_RESULT] = "large_result",
+	[PWS_KIND_WAL] = "wal",
+	[PWS_KIND_TUPLE_COST] = "tuple_cost",
+	[PWS_KIND_PARTITIONS] = "partitions",
+	[PWS_KIND_MEMOIZE] = "memoize",
+	[PWS_KIND_RECURSION] = "recursion",
+	[PWS_KIND_SEQSCAN_CALLER] = "seqscan_caller",
+};
+
+/* Counters of each kind that keep their maximum rather than their sum */
+static const uint32 pwsKindMaxCounters[PWS_NUM_KINDS] = {
+	[PWS_KIND_MEMOIZE] = (1 << 4),	/* peak memory */
+	[PWS_KIND_RECURSION] = (1 << 2),	/* deepest recursion */
+};
+
+typedef struct pwsHashKey
+{
+	int32		kind;			/* pwsKind */
+	Oid			dbid;			/* database OID */
+	int64		queryid;		/* query identifier, or 0 */
+	Oid			relid;			/* relation OID, or InvalidOid */
+	Oid			funcid;			/* function OID, or InvalidOid */
+	int32		plan_node_id;	/* plan node, or -1 */
+	NameData	label;			/* free-form label, or empty */
+} pwsHashKey;
+
+typedef struct pwsEntry
+{
+	pwsHashKey	key;			/* hash key of entry - MUST BE FIRST */
+	slock_t		mutex;			/* protects the fields below */
+	int64		calls;			/* number of accumulated findings */
+	double		counters[PWS_NUM_COUNTERS];
+	TimestampTz last_seen;		/* time of the last accumulation */
+} pwsEntry;
+
+/*
+ * Planner cost calibration.
+ *
+ * For each tablespace, sampled scan nodes feed a least-squares fit of node
+ * time against the pages read sequentially, the pages read randomly and the
+ * tuples processed.  Only the sums needed by the normal equations are kept.
+ */
+#define PWS_CALIB_SEQ_PAGES		0
+#define PWS_CALIB_RANDOM_PAGES	1
+#define PWS_CALIB_TUPLES		2
+#define PWS_CALIB_NVARS			3
+
+#define PWS_CALIB_MAX_TABLESPACES	64
+
+typedef struct pwsCalibEntry
+{
+	Oid			spcid;			/* tablespace OID - MUST BE FIRST */
+	int64		samples;		/* number of scan nodes sampled */
+	double		xtx[PWS_CALIB_NVARS][PWS_CALIB_NVARS];	/* sum of x * x' */
+	double		xty[PWS_CALIB_NVARS];	/* sum of x * time */
+	double		yty;			/* sum of time^2 */
+} pwsCalibEntry;
+
+/*
+ * Folded stacks of sampled queries, for flame graphs.
+ *
+ * Each entry is one path from a query down to a plan node, such as
+ * "1234;Hash Join;Seq Scan on orders", with the self time of the node.
+ * Paths longer than PWS_STACK_LEN are cut, and end with "...".
+ */
+#define PWS_STACK_LEN	512
+
+typedef struct pwsStackKey
+{
+	Oid			dbid;			/* database OID */
+	char		stack[PWS_STACK_LEN];	/* frames, separated by ';' */
+} pwsStackKey;
+
+typedef struct pwsStackEntry
+{
+	pwsStackKey key;			/* hash key of entry - MUST BE FIRST */
+	int64		samples;		/* number of node executions sampled */
+	double		self_time;		/* total self time, in msec */
+} pwsStackEntry;
+
+/* Links to shared memory state, NULL unless loaded at server start */
+pwsSharedState *pws = NULL;
+static HTAB *pws_hash = NULL;
+static HTAB *pws_calib_hash = NULL;
+HTAB	   *pws_node_hash = NULL;
+static HTAB *pws_stack_hash = NULL;
+pwsCaptureQueue *pws_queue = NULL;
+
+/* Is this the background worker persisting captures? */
+bool		am_persist_worker = false;
+
+/* Folded stacks of a query being recorded, see CollectFoldedStacks */
+typedef struct FoldedStackSample
+{
+	char	   *stack;			/* frames, separated by ';' */
+	double		self_time;		/* in msec */
+} FoldedStackSample;
+
+typedef struct FoldedStackContext
+{
+	StringInfoData stack;		/* frames of the parents of the current node */
+	List	   *samples;		/* list of FoldedStackSample */
+} FoldedStackContext;
+
+/* EXPLAIN (PLAN_WATCH) support */
+typedef struct PlanWatchExplainState
+{
+	bool		enabled;		/* PLAN_WATCH option given */
+	int64		planid;			/* fingerprint of the plan being explained */
+	List	   *visited;		/* PlanStates explained so far */
+} PlanWatchExplainState;
+
+static int	es_extension_id;
+
+/*
+ * Executions of each query within the current transaction, used to spot
+ * N+1 query patterns.  Nested executions are counted separately, and are
+ * reported at the end of their top-level statement rather than at the end
+ * of the transaction.
+ */
+#define PW_MAX_REPEATED_QUERIES	1024
+
+typedef struct RepeatedQueryKey
+{
+	int64		queryid;		/* query identifier */
+	int32		nested;			/* executed at nesting_level > 0? */
+} RepeatedQueryKey;
+
+typedef struct RepeatedQueryEntry
+{
+	RepeatedQueryKey key;		/* hash key of entry - MUST BE FIRST */
+	int64		calls;			/* number of executions */
+	double		total_time;		/* total execution time, in msec */
+} RepeatedQueryEntry;
+
+/* Lives in TopTransactionContext, NULL if nothing counted in this xact */
+static HTAB *repeated_queries = NULL;
+
+/*
+ * Summary of the nested statements captured during the current top-level
+ * statement, when log_nested_summary is on.  Each distinct inner plan is
+ * rendered once, on its first capture; later captures only add to its
+ * counters.  Everything lives in nested_summary_cxt, which is reset when
+ * the summary is logged.
+ */
+#define PW_NESTED_SUMMARY_MAX_PLANS	100
+
+typedef struct NestedSummaryKey
+{
+	int64		queryid;		/* query identifier */
+	uint64		fingerprint;	/* see FingerprintPlanState */
+} NestedSummaryKey;
+
+typedef struct NestedSummaryEntry
+{
+	NestedSummaryKey key;		/* hash key of entry - MUST BE FIRST */
+	int			seq;			/* order of first capture */
+	int64		captures;		/* number of captures */
+	double		rows;			/* total rows processed */
+	double		total_time;		/* total duration, in msec */
+	char	   *detectors;		/* what flagged the first capture */
+	char	   *plan;			/* plan of the first capture */
+} NestedSummaryEntry;
+
+static MemoryContext nested_summary_cxt = NULL;
+static HTAB *nested_summary = NULL;
+static int64 nested_summary_overflow = 0;	/* captures not summarized */
+
+/*
+ * Captures rendered during the current transaction, when log_batch_size is
+ * set.  They are written as one log entry at transaction end, or earlier if
+ * the batch grows past log_batch_size or log_batch_max_age.
+ */
+static MemoryContext capture_batch_cxt = NULL;
+static StringInfo capture_batch = NULL;
+static int	capture_batch_count = 0;
+static TimestampTz capture_batch_start = 0;
+
+/*
+ * Per-query state kept while a watched query runs.
+ *
+ * It is allocated in the query's es_query_cxt and linked into
+ * active_queries; a reset callback on that context unlinks it, so it goes
+ * away with the query even on error.
+ */
+typedef struct FirstRowReceiver FirstRowReceiver;
+
+typedef struct PlanWatchQueryState
+{
+	dlist_node	node;			/* link in active_queries */
+	QueryDesc  *queryDesc;		/* the query this state belongs to */
+	MemoryContextCallback cb;	/* unlinks us when es_query_cxt goes away */
+
+	/* time to first row, see explain_ExecutorRun */
+	bool		run_started;	/* has ExecutorRun been called yet? */
+	instr_time	run_start;		/* when ExecutorRun was first called */
+	bool		first_row_seen; /* has a row been sent yet? */
+	double		first_row_time; /* msec from run_start to first row */
+	FirstRowReceiver *receiver; /* wrapper around queryDesc->dest */
+
+	/* user-defined function calls, see pg_plan_watch_fmgr_hook */
+	HTAB	   *function_usage; /* FunctionUsage entries, or NULL */
+} PlanWatchQueryState;
+
+/*
+ * Calls of one user-defined function made by the expressions of a query.
+ */
+typedef struct FunctionUsage
+{
+	Oid			fn_oid;			/* hash key - MUST BE FIRST */
+	int64		calls;			/* number of calls */
+	double		total_time;		/* total time, in msec */
+	int			depth;			/* current recursion depth */
+	instr_time	start;			/* start of the outermost active call */
+} FunctionUsage;
+
+/*
+ * DestReceiver that notes when the first row is sent, and passes everything
+ * on to the query's real destination.
+ */
+struct FirstRowReceiver
+{
+	DestReceiver pub;
+	DestReceiver *target;		/* the query's real destination */
+	PlanWatchQueryState *qstate;
+};
+
+static dlist_head active_queries = DLIST_STATIC_INIT(active_queries);
+
+/*
+ * A finding reported by one of the detectors, printed along with the plan.
+ */
+typedef struct PlanWatchFinding
+{
+	const char *detector;		/* name of the detector */
+	int			plan_node_id;	/* plan node concerned, or -1 */
+	char	   *detail;			/* human-readable description */
+} PlanWatchFinding;
+
+/*
+ * State collected while walking the plan of a finished query.
+ */
+typedef struct PlanWatchContext
+{
+	QueryDesc  *queryDesc;
+	bool		sampled;		/* timed for the shared statistics */
+	bool		over_limit;		/* some node exceeded log_seqscan_threshold */
+	bool		wal_flagged;	/* query exceeded log_wal_threshold */
+	HTAB	   *function_usage; /* FunctionUsage entries of the query */
+	List	   *ancestors;		/* parents of the node being visited */
+	bool		force_verbose;	/* log the plan with VERBOSE */
+	List	   *findings;		/* list of PlanWatchFinding */
+	List	   *cost_samples;	/* pwsCalibEntry sums, see CollectCostSample */
+} PlanWatchContext;
 
 /* Saved hook values */
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+static fmgr_hook_type prev_fmgr_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static explain_per_node_hook_type prev_explain_per_node_hook = NULL;
 
 static bool explain_ExecutorStart(QueryDesc *queryDesc, int eflags);
 static void explain_ExecutorRun(QueryDesc *queryDesc,
@@ -82,8 +475,128 @@ static void explain_ExecutorRun(QueryDesc *queryDesc,
 								uint64 count);
 static void explain_ExecutorFinish(QueryDesc *queryDesc);
 static void explain_ExecutorEnd(QueryDesc *queryDesc);
+static void pg_plan_watch_ProcessUtility(PlannedStmt *pstmt,
+										 const char *queryString,
+										 bool readOnlyTree,
+										 ProcessUtilityContext context,
+										 ParamListInfo params,
+										 QueryEnvironment *queryEnv,
+										 DestReceiver *dest,
+										 QueryCompletion *qc);
+static void SampleTopLevelStatement(void);
+static void EndTopLevelStatement(void);
+
+static void pg_plan_watch_xact_callback(XactEvent event, void *arg);
+static void plan_watch_explain_option(ExplainState *es, DefElem *opt,
+									  ParseState *pstate);
+static void plan_watch_explain_per_node(PlanState *planstate, List *ancestors,
+										const char *relationship,
+										const char *plan_name,
+										ExplainState *es);
+static char *DescribeWouldTrip(PlanState *planstate, List *ancestors,
+							   ExplainState *es);
+static List *AncestorPlanStates(PlanWatchExplainState *state, List *ancestors);
+static bool FinishInstrumentation(PlanState *planstate, void *context);
+static void RecordNodeHistory(QueryDesc *queryDesc, PlanWatchContext *ctx,
+							  bool captured);
+static bool CollectPlanNodes(PlanState *planstate, void *context);
+static double pws_rows_percentile(const pwsNodeEntry *entry, double fraction);
+static void RecordFoldedStacks(QueryDesc *queryDesc);
+static bool CollectFoldedStacks(PlanState *planstate, void *context);
+static void CountRepeatedQuery(QueryDesc *queryDesc);
+static void ReportRepeatedQueries(bool nested_only);
+
+static PlanWatchQueryState *GetQueryState(QueryDesc *queryDesc, bool create);
+static void ReleaseQueryState(void *arg);
+static bool first_row_receive(TupleTableSlot *slot, DestReceiver *self);
+static void first_row_startup(DestReceiver *self, int operation,
+							  TupleDesc typeinfo);
+static void first_row_shutdown(DestReceiver *self);
+static void first_row_destroy(DestReceiver *self);
+
+static bool pg_plan_watch_needs_fmgr_hook(Oid fn_oid);
+static void pg_plan_watch_fmgr_hook(FmgrHookEventType event,
+									FmgrInfo *flinfo, Datum *arg);
+static void AttributeFunctionCalls(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static bool AttributeNodeFunctionCalls(PlanState *planstate, void *context);
+
+static void pws_shmem_request(void);
+static void pws_shmem_startup(void);
+static Size pws_memsize(void);
+static void pws_accum(pwsKind kind, int64 queryid, Oid relid, Oid funcid,
+					  int plan_node_id, const char *label,
+					  const double *counters, int ncounters);
 
-static bool DetectSeqScanOverLimit(PlanState *planstate, void *context);
+static char *RenderPlan(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static char *LogPlan(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static void SummarizeNestedCapture(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static void LogNestedSummary(void);
+static void WriteCapture(const char *capture);
+static void FlushCaptureBatch(void);
+static bool FingerprintPlanState(PlanState *planstate, void *context);
+static void ExplainPrintCaller(ExplainState *es);
+static void ExplainPrintFindings(ExplainState *es, List *findings);
+static void AddFinding(PlanWatchContext *ctx, const char *detector,
+					   PlanState *planstate, const char *fmt,...)
+			pg_attribute_printf(4, 5);
+static bool WatchPlanState(PlanState *planstate, void *context);
+static bool DetectSeqScanOverLimit(PlanState *planstate);
+static void DetectSeqScanBloat(ScanState *node, PlanWatchContext *ctx);
+static void AccumSeqScanCaller(ScanState *node, PlanWatchContext *ctx);
+static void DetectSubPlanLoops(PlanState *planstate, PlanWatchContext *ctx);
+static bool SubPlanLoopsTrip(SubPlanState *sps);
+static bool SumLeafRows(PlanState *planstate, void *context);
+static bool PlanStateHasChildren(PlanState *planstate);
+static void DetectLimitWaste(LimitState *node, PlanWatchContext *ctx);
+static bool LimitWasteTrips(LimitState *node, double *returned,
+							double *consumed, PlanState **sort,
+							PlanState **scan);
+static char *DescribeSortKeys(Sort *sort, PlanState *scan);
+static const char *PlanNodeName(Plan *plan, Index *scanrelid);
+static void DetectLargeResult(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static void DetectWalVolume(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static void AccumModifyTableWal(ModifyTableState *node, PlanWatchContext *ctx);
+static void DetectFirstRowLatency(QueryDesc *queryDesc, PlanWatchContext *ctx);
+static bool CollectBlockingNodes(PlanState *planstate, void *context);
+static void DetectTupleCost(PlanState *planstate, PlanWatchContext *ctx);
+static bool TupleCostTrips(PlanState *planstate, double *tuples,
+						   double *self_time);
+static bool SumChildTime(PlanState *planstate, void *context);
+static char *DescribeCalledFunctions(List *exprs);
+static bool CollectFunctionIds(Node *node, List **funcids);
+static void DetectPartitionScans(PlanState *planstate, PlanWatchContext *ctx);
+static bool PartitionScansTrip(PlanState *planstate, int *scanned, int *total,
+							   Oid *relid);
+static int	CountLeafPartitions(Relation rel);
+static void DetectMemoizeEfficiency(MemoizeState *node, PlanWatchContext *ctx);
+static bool MemoizeHitRatioTrips(MemoizeState *node,
+								 MemoizeInstrumentation *stats);
+static void DetectForeignPassThrough(ForeignScanState *node,
+									 PlanWatchContext *ctx);
+static bool ForeignPassThroughTrips(ForeignScanState *node, List *ancestors,
+									double *fetched, double *surviving,
+									PlanState **survivor);
+static void DetectRecursionExplosion(RecursiveUnionState *node,
+									 PlanWatchContext *ctx);
+static bool RecursionTrips(RecursiveUnionState *node, double *iterations,
+						   double *rows);
+static void CollectCostSample(ScanState *node, PlanWatchContext *ctx);
+static void FlushCostSamples(PlanWatchContext *ctx);
+static bool pws_calib_fit(const pwsCalibEntry *entry,
+						  bool active[PWS_CALIB_NVARS],
+						  double beta[PWS_CALIB_NVARS],
+						  double cov[PWS_CALIB_NVARS][PWS_CALIB_NVARS],
+						  bool *have_cov);
+static void pws_ratio_ci(const double beta[PWS_CALIB_NVARS],
+						 double cov[PWS_CALIB_NVARS][PWS_CALIB_NVARS],
+						 int num, int den,
+						 double *estimate, double *low, double *high);
+
+PG_FUNCTION_INFO_V1(pg_plan_watch_stats);
+PG_FUNCTION_INFO_V1(pg_plan_watch_reset);
+PG_FUNCTION_INFO_V1(pg_plan_watch_cost_calibration);
+PG_FUNCTION_INFO_V1(pg_plan_watch_node_stats);
+PG_FUNCTION_INFO_V1(pg_plan_watch_folded_stacks);
 
 /*
  * Module load callback
@@ -104,6 +617,184 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("pg_plan_watch.log_subplan_loops_threshold",
+							"Sets the minimum executions of a correlated SubPlan which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_subplan_loops_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_limit_wasted_rows",
+							"Sets the minimum rows read but discarded below a Limit node which plans will be logged.",
+							"Counts rows skipped by OFFSET and rows sorted from a sequential scan to return the first few. "
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_limit_wasted_rows,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_repeated_query_threshold",
+							"Sets the minimum executions of the same query within a transaction which will be logged.",
+							"Queries executed by a function are counted within their top-level statement. "
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_repeated_query_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_result_rows_threshold",
+							"Sets the minimum rows sent to the client which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_result_rows_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_result_size_threshold",
+							"Sets the minimum estimated size of the rows sent to the client which plans will be logged.",
+							"The size is estimated from the planned row width. "
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_result_size_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_wal_threshold",
+							"Sets the minimum WAL generated by a query which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_wal_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_first_row_threshold",
+							"Sets the minimum time to the first row sent which plans will be logged.",
+							"The time is counted from the first execution of the query, "
+							"so that it also covers cursors fetching their first row. "
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_first_row_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_tuple_cost_threshold",
+							"Sets the minimum time per tuple spent in a plan node which plans will be logged.",
+							"Only queries collecting timing data are checked, see log_timing and sample_rate. "
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_tuple_cost_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_partitions_threshold",
+							"Sets the minimum partitions scanned by an Append or MergeAppend node which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_partitions_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_plan_watch.log_partitions_fraction",
+							 "Sets the minimum fraction of the partitions of a table scanned by an Append or MergeAppend node which plans will be logged.",
+							 "-1 turns this feature off.",
+							 &pg_plan_watch_log_partitions_fraction,
+							 -1.0,
+							 -1.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_plan_watch.log_memoize_hit_ratio",
+							 "Sets the cache hit ratio of a Memoize node below which plans will be logged.",
+							 "-1 turns this feature off.",
+							 &pg_plan_watch_log_memoize_hit_ratio,
+							 -1.0,
+							 -1.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_plan_watch.log_foreign_pass_ratio",
+							 "Sets the fraction of the rows fetched by a foreign scan surviving local processing below which plans will be logged.",
+							 "Such plans are logged with VERBOSE, to show the remote query. "
+							 "-1 turns this feature off.",
+							 &pg_plan_watch_log_foreign_pass_ratio,
+							 -1.0,
+							 -1.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_recursion_depth_threshold",
+							"Sets the minimum iterations of a recursive query which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_recursion_depth_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_recursion_rows_threshold",
+							"Sets the minimum rows produced by the recursive term of a recursive query which plans will be logged.",
+							"-1 turns this feature off.",
+							&pg_plan_watch_log_recursion_rows_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_plan_watch.log_parameter_max_length",
 							"Sets the maximum length of query parameter values to log.",
 							"-1 means log values in full.",
@@ -217,6 +908,45 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("pg_plan_watch.log_nested_summary",
+							 "Summarize nested statements in one log entry per top-level statement.",
+							 "Each distinct nested plan is logged once, with the number of captures, "
+							 "rows and duration.  This has no effect unless log_nested_statements is also set.  "
+							 "When both are set, statements run by DO and CALL are summarized "
+							 "as nested statements too.",
+							 &pg_plan_watch_log_nested_summary,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_batch_size",
+							"Sets the size of the per-transaction buffer of captured plans.",
+							"Captures are logged together at transaction end, or as soon as the "
+							"buffer holds this much.  -1 logs each capture immediately.",
+							&pg_plan_watch_log_batch_size,
+							-1,
+							-1, MaxAllocSize / 2048,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.log_batch_max_age",
+							"Sets the longest time a captured plan is held in the per-transaction buffer.",
+							"The age is checked when a capture is added.  -1 means no limit.",
+							&pg_plan_watch_log_batch_max_age,
+							10000,
+							-1, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomBoolVariable("pg_plan_watch.log_timing",
 							 "Collect timing data, not just row counts.",
 							 NULL,
@@ -228,34 +958,478 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
-	MarkGUCPrefixReserved("pg_plan_watch");
+	DefineCustomBoolVariable("pg_plan_watch.track_functions",
+							 "Attribute calls of user-defined functions to the plan nodes calling them.",
+							 "Only watched queries are tracked.  Their function calls go through the "
+							 "function manager hook, which adds some overhead to each call.",
+							 &pg_plan_watch_track_functions,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
 
-	/* Install hooks. */
-	prev_ExecutorStart = ExecutorStart_hook;
-	ExecutorStart_hook = explain_ExecutorStart;
-	prev_ExecutorRun = ExecutorRun_hook;
-	ExecutorRun_hook = explain_ExecutorRun;
-	prev_ExecutorFinish = ExecutorFinish_hook;
-	ExecutorFinish_hook = explain_ExecutorFinish;
-	prev_ExecutorEnd = ExecutorEnd_hook;
-	ExecutorEnd_hook = explain_ExecutorEnd;
-}
+	DefineCustomBoolVariable("pg_plan_watch.track_callers",
+							 "Attribute watched statements to the user-defined function running them.",
+							 "Captured plans name the calling function, and the flagged sequential scans "
+							 "of watched statements are accumulated per top-level query, calling function "
+							 "and relation.  Calls of procedural functions go through the function "
+							 "manager hook, which adds some overhead to each call.",
+							 &pg_plan_watch_track_callers,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
 
-/*
- * ExecutorStart hook: start up logging if needed
- */
-static bool
-explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
-{
-	bool		plan_valid;
+	DefineCustomStringVariable("pg_plan_watch.otlp_target",
+							   "Exports the analyzed plans of captured queries as OTLP/JSON spans.",
+							   "Either a file, to which one ExportTraceServiceRequest is appended per "
+							   "line, or \"unix:\" followed by the path of a collector's datagram socket, "
+							   "which gets one request per datagram.  Requests that can't be sent at once "
+							   "are dropped.  Empty turns this feature off.",
+							   &pg_plan_watch_otlp_target,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
 
-	if (pg_plan_watch_enabled())
-	{
-		/* Enable per-node instrumentation iff log_analyze is required. */
-		if (pg_plan_watch_log_analyze && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
-		{
-			if (pg_plan_watch_log_timing)
-				queryDesc->instrument_options |= INSTRUMENT_TIMER;
+	DefineCustomStringVariable("pg_plan_watch.trace_context",
+							   "Sets the W3C traceparent under which exported spans are nested.",
+							   "If empty, a traceparent found in application_name is used, "
+							   "and failing that, a new trace is started.",
+							   &pg_plan_watch_trace_context,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_plan_watch.metrics_target",
+							   "Sends a statsd datagram for each sequential scan over log_seqscan_threshold.",
+							   "Either \"unix:\" followed by the path of a datagram socket, or host:port "
+							   "for UDP.  Datagrams that can't be sent at once are dropped.  "
+							   "Empty turns this feature off.",
+							   &pg_plan_watch_metrics_target,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_plan_watch.persist_database",
+							   "Sets the database in which captured plans are persisted.",
+							   "A background worker inserts captures into the pg_plan_watch_captures "
+							   "table of the extension in that database.  Empty turns this feature off.",
+							   &pg_plan_watch_persist_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.persist_queue_size",
+							"Sets the number of captures that can wait to be persisted.",
+							"Captures are dropped while the queue is full.",
+							&pg_plan_watch_persist_queue_size,
+							128,
+							16, 65536,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.persist_naptime",
+							"Sets the time between batches of persisted captures.",
+							NULL,
+							&pg_plan_watch_persist_naptime,
+							1000,
+							10, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.persist_retention",
+							"Sets the number of days persisted captures are kept.",
+							"Daily partitions older than this are dropped.",
+							&pg_plan_watch_persist_retention,
+							7,
+							1, 36500,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_plan_watch.capture_file",
+							   "Sets the file captured plans are written into.",
+							   "The file is a ring of fixed-size records, that programs can "
+							   "follow by mapping it.  Relative paths are relative to the data "
+							   "directory.  Empty turns this feature off.",
+							   &pg_plan_watch_capture_file,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.capture_file_slots",
+							"Sets the number of captures the capture file holds.",
+							"Each takes 8kB; older captures are overwritten.",
+							&pg_plan_watch_capture_file_slots,
+							1024,
+							16, 1048576,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.max_entries",
+							"Sets the maximum number of statistics entries kept in shared memory.",
+							"New findings are not accumulated once the limit is reached.",
+							&pg_plan_watch_max_entries,
+							5000,
+							100, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.max_nodes",
+							"Sets the maximum number of plan nodes whose history is kept in shared memory.",
+							"Nodes of new queries are not recorded once the limit is reached.",
+							&pg_plan_watch_max_nodes,
+							10000,
+							100, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_watch.max_stacks",
+							"Sets the maximum number of folded stacks kept in shared memory.",
+							"New stacks are not recorded once the limit is reached.",
+							&pg_plan_watch_max_stacks,
+							5000,
+							100, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_plan_watch.sample_rate",
+							 "Fraction of queries to time for the shared statistics.",
+							 "Sampled queries run with per-node timing and buffer usage instrumentation.",
+							 &pg_plan_watch_sample_rate,
+							 0.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	MarkGUCPrefixReserved("pg_plan_watch");
+
+	/*
+	 * Shared-memory statistics are only available when we are loaded via
+	 * shared_preload_libraries.  Plan logging works either way.
+	 */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = pws_shmem_request;
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = pws_shmem_startup;
+
+		if (pg_plan_watch_persist_database[0] != '\0')
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+				BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+			worker.bgw_restart_time = 10;
+			strcpy(worker.bgw_library_name, "pg_plan_watch");
+			strcpy(worker.bgw_function_name, "pg_plan_watch_persist_main");
+			strcpy(worker.bgw_name, "pg_plan_watch persister");
+			strcpy(worker.bgw_type, "pg_plan_watch persister");
+			RegisterBackgroundWorker(&worker);
+		}
+	}
+
+	/* Install hooks. */
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = explain_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = explain_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = explain_ExecutorFinish;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = explain_ExecutorEnd;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = pg_plan_watch_ProcessUtility;
+	prev_needs_fmgr_hook = needs_fmgr_hook;
+	needs_fmgr_hook = pg_plan_watch_needs_fmgr_hook;
+	prev_fmgr_hook = fmgr_hook;
+	fmgr_hook = pg_plan_watch_fmgr_hook;
+	prev_explain_per_node_hook = explain_per_node_hook;
+	explain_per_node_hook = plan_watch_explain_per_node;
+
+	RegisterXactCallback(pg_plan_watch_xact_callback, NULL);
+
+	/* Register the PLAN_WATCH option of EXPLAIN. */
+	es_extension_id = GetExplainExtensionId("pg_plan_watch");
+	RegisterExtensionExplainOption("plan_watch", plan_watch_explain_option);
+}
+
+/*
+ * shmem_request hook: request additional shared resources
+ */
+static void
+pws_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pws_memsize());
+	RequestNamedLWLockTranche("pg_plan_watch", 2);
+}
+
+/*
+ * shmem_startup hook: allocate or attach to shared memory
+ */
+static void
+pws_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	/* reset in case this is a restart within the postmaster */
+	pws = NULL;
+	pws_hash = NULL;
+	pws_calib_hash = NULL;
+	pws_node_hash = NULL;
+	pws_stack_hash = NULL;
+	pws_queue = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pws = ShmemInitStruct("pg_plan_watch",
+						  sizeof(pwsSharedState),
+						  &found);
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_plan_watch");
+
+		pws->lock = &locks[0].lock;
+		pws->queue_lock = &locks[1].lock;
+		pg_atomic_init_u64(&pws->metrics_sent, 0);
+		pg_atomic_init_u64(&pws->metrics_dropped, 0);
+	}
+
+	info.keysize = sizeof(pwsHashKey);
+	info.entrysize = sizeof(pwsEntry);
+	pws_hash = ShmemInitHash("pg_plan_watch hash",
+							 pg_plan_watch_max_entries,
+							 pg_plan_watch_max_entries,
+							 &info,
+							 HASH_ELEM | HASH_BLOBS);
+
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(pwsCalibEntry);
+	pws_calib_hash = ShmemInitHash("pg_plan_watch calibration hash",
+								   PWS_CALIB_MAX_TABLESPACES,
+								   PWS_CALIB_MAX_TABLESPACES,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS);
+
+	info.keysize = sizeof(pwsNodeKey);
+	info.entrysize = sizeof(pwsNodeEntry);
+	pws_node_hash = ShmemInitHash("pg_plan_watch node hash",
+								  pg_plan_watch_max_nodes,
+								  pg_plan_watch_max_nodes,
+								  &info,
+								  HASH_ELEM | HASH_BLOBS);
+
+	info.keysize = sizeof(pwsStackKey);
+	info.entrysize = sizeof(pwsStackEntry);
+	pws_stack_hash = ShmemInitHash("pg_plan_watch stack hash",
+								   pg_plan_watch_max_stacks,
+								   pg_plan_watch_max_stacks,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS);
+
+	if (pg_plan_watch_persist_database[0] != '\0')
+	{
+		pws_queue = ShmemInitStruct("pg_plan_watch capture queue",
+									add_size(offsetof(pwsCaptureQueue, records),
+											 mul_size(pg_plan_watch_persist_queue_size,
+													  sizeof(pwsCaptureRecord))),
+									&found);
+		if (!found)
+		{
+			pws_queue->worker = NULL;
+			pws_queue->head = 0;
+			pws_queue->tail = 0;
+			pws_queue->dropped = 0;
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (pg_plan_watch_capture_file[0] != '\0')
+		MapCaptureFile();
+}
+
+/*
+ * Estimate shared memory space needed.
+ */
+static Size
+pws_memsize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(pwsSharedState));
+	size = add_size(size, hash_estimate_size(pg_plan_watch_max_entries,
+											 sizeof(pwsEntry)));
+	size = add_size(size, hash_estimate_size(PWS_CALIB_MAX_TABLESPACES,
+											 sizeof(pwsCalibEntry)));
+	size = add_size(size, hash_estimate_size(pg_plan_watch_max_nodes,
+											 sizeof(pwsNodeEntry)));
+	size = add_size(size, hash_estimate_size(pg_plan_watch_max_stacks,
+											 sizeof(pwsStackEntry)));
+	if (pg_plan_watch_persist_database[0] != '\0')
+		size = add_size(size,
+						add_size(offsetof(pwsCaptureQueue, records),
+								 mul_size(pg_plan_watch_persist_queue_size,
+										  sizeof(pwsCaptureRecord))));
+
+	return size;
+}
+
+/*
+ * Add a finding to the shared statistics.
+ *
+ * The counters are summed (or maxed, see pwsKindMaxCounters) into the entry
+ * identified by the other arguments, which is created if needed.  Nothing
+ * happens if shared memory is not available or the hash table is full.
+ */
+static void
+pws_accum(pwsKind kind, int64 queryid, Oid relid, Oid funcid,
+		  int plan_node_id, const char *label,
+		  const double *counters, int ncounters)
+{
+	pwsHashKey	key;
+	pwsEntry   *entry;
+	TimestampTz now;
+
+	Assert(ncounters <= PWS_NUM_COUNTERS);
+
+	/*
+	 * Safety check; also, parallel workers' instrumentation is folded into
+	 * the leader's, so only the leader accumulates.
+	 */
+	if (!pws || !pws_hash || IsParallelWorker())
+		return;
+
+	/* Set up key for hashtable search (clear padding, if any) */
+	memset(&key, 0, sizeof(key));
+	key.kind = kind;
+	key.dbid = MyDatabaseId;
+	key.queryid = queryid;
+	key.relid = relid;
+	key.funcid = funcid;
+	key.plan_node_id = plan_node_id;
+	if (label)
+		strlcpy(NameStr(key.label), label, NAMEDATALEN);
+
+	/* Lookup the hash table entry with shared lock. */
+	LWLockAcquire(pws->lock, LW_SHARED);
+
+	entry = (pwsEntry *) hash_search(pws_hash, &key, HASH_FIND, NULL);
+
+	/* Create new entry, if not present */
+	if (!entry)
+	{
+		bool		found;
+
+		/* Need exclusive lock to make a new hashtable entry */
+		LWLockRelease(pws->lock);
+		LWLockAcquire(pws->lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(pws_hash) >= pg_plan_watch_max_entries)
+		{
+			LWLockRelease(pws->lock);
+			return;
+		}
+
+		entry = (pwsEntry *) hash_search(pws_hash, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->calls = 0;
+			memset(entry->counters, 0, sizeof(entry->counters));
+			entry->last_seen = 0;
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	/* Don't make a system call while holding the spinlock */
+	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&entry->mutex);
+	entry->calls++;
+	for (int i = 0; i < ncounters; i++)
+	{
+		if (pwsKindMaxCounters[kind] & (1 << i))
+			entry->counters[i] = Max(entry->counters[i], counters[i]);
+		else
+			entry->counters[i] += counters[i];
+	}
+	entry->last_seen = now;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(pws->lock);
+}
+
+/*
+ * ExecutorStart hook: start up logging if needed
+ */
+static bool
+explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	bool		plan_valid;
+
+	if (nesting_level == 0)
+		SampleTopLevelStatement();
+
+	if (pg_plan_watch_enabled())
+	{
+		/* Enable per-node instrumentation iff log_analyze is required. */
+		if (pg_plan_watch_log_analyze && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+		{
+			if (pg_plan_watch_log_timing)
+				queryDesc->instrument_options |= INSTRUMENT_TIMER;
 			else
 				queryDesc->instrument_options |= INSTRUMENT_ROWS;
 			if (pg_plan_watch_log_buffers)
@@ -265,20 +1439,43 @@ explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		}
 
 		/* We need to know number of processed rows per node */
-		if (pg_plan_watch_log_seqscan_threshold >= 0 && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+		if (pg_plan_watch_detectors_enabled() && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
 			queryDesc->instrument_options |= INSTRUMENT_ROWS;
+
+		/* Attribute WAL to the relations modified by each ModifyTable node */
+		if (pg_plan_watch_log_wal_threshold >= 0 && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+			queryDesc->instrument_options |= INSTRUMENT_WAL;
+
+		/* Sampled queries are timed for the shared statistics */
+		if (current_query_sampled && (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+			queryDesc->instrument_options |= INSTRUMENT_TIMER | INSTRUMENT_BUFFERS;
 	}
 
-	if (prev_ExecutorStart)
-		plan_valid = prev_ExecutorStart(queryDesc, eflags);
-	else
-		plan_valid = standard_ExecutorStart(queryDesc, eflags);
+	/*
+	 * Functions are looked up while the plan is initialized, so that's when
+	 * we decide whether their calls will be tracked.
+	 */
+	function_tracking_active = (pg_plan_watch_enabled() &&
+								pg_plan_watch_track_functions &&
+								(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0);
+	PG_TRY();
+	{
+		if (prev_ExecutorStart)
+			plan_valid = prev_ExecutorStart(queryDesc, eflags);
+		else
+			plan_valid = standard_ExecutorStart(queryDesc, eflags);
+	}
+	PG_FINALLY();
+	{
+		function_tracking_active = false;
+	}
+	PG_END_TRY();
 
 	/* The plan may have become invalid during standard_ExecutorStart() */
 	if (!plan_valid)
 		return false;
 
-	if (pg_plan_watch_enabled())
+	if (pg_plan_watch_enabled() || pg_plan_watch_log_repeated_query_threshold >= 0)
 	{
 		/*
 		 * Set up to track total elapsed time in ExecutorRun.  Make sure the
@@ -293,18 +1490,62 @@ explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
 			queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
 			MemoryContextSwitchTo(oldcxt);
 		}
+
+		/*
+		 * Set up to measure the time to the first row in ExecutorRun, and to
+		 * collect function calls in pg_plan_watch_fmgr_hook.
+		 */
+		if (pg_plan_watch_enabled() &&
+			(pg_plan_watch_log_first_row_threshold >= 0 ||
+			 pg_plan_watch_track_functions) &&
+			(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+			(void) GetQueryState(queryDesc, true);
 	}
 
 	return true;
 }
 
 /*
- * ExecutorRun hook: all we need do is track nesting depth
+ * ExecutorRun hook: track nesting depth, and the time to the first row
+ *
+ * Until the first row has been sent, the query's destination is wrapped in
+ * a FirstRowReceiver for the duration of the call.  The caller may pass a
+ * new destination each time (as FETCH does), so the wrapper is put back on
+ * every call that may still send the first row.
  */
 static void
 explain_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
 					uint64 count)
 {
+	PlanWatchQueryState *qstate = NULL;
+	DestReceiver *dest = queryDesc->dest;
+
+	if (!dlist_is_empty(&active_queries))
+		qstate = GetQueryState(queryDesc, false);
+
+	if (qstate && !qstate->first_row_seen)
+	{
+		if (!qstate->run_started)
+		{
+			INSTR_TIME_SET_CURRENT(qstate->run_start);
+			qstate->run_started = true;
+		}
+
+		if (qstate->receiver == NULL)
+		{
+			qstate->receiver = MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+													  sizeof(FirstRowReceiver));
+			qstate->receiver->pub.receiveSlot = first_row_receive;
+			qstate->receiver->pub.rStartup = first_row_startup;
+			qstate->receiver->pub.rShutdown = first_row_shutdown;
+			qstate->receiver->pub.rDestroy = first_row_destroy;
+			qstate->receiver->qstate = qstate;
+		}
+		qstate->receiver->pub.mydest = dest->mydest;
+		qstate->receiver->target = dest;
+		queryDesc->dest = &qstate->receiver->pub;
+	}
+
 	nesting_level++;
 	PG_TRY();
 	{
@@ -316,6 +1557,7 @@ explain_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
 	PG_FINALLY();
 	{
 		nesting_level--;
+		queryDesc->dest = dest;
 	}
 	PG_END_TRY();
 }
@@ -347,9 +1589,13 @@ explain_ExecutorFinish(QueryDesc *queryDesc)
 static void
 explain_ExecutorEnd(QueryDesc *queryDesc)
 {
+	CountRepeatedQuery(queryDesc);
+
 	if (queryDesc->totaltime && pg_plan_watch_enabled())
 	{
 		MemoryContext oldcxt;
+		PlanWatchContext ctx;
+		bool		captured;
 
 		/*
 		 * Make sure we operate in the per-query context, so any cruft will be
@@ -363,57 +1609,64 @@ explain_ExecutorEnd(QueryDesc *queryDesc)
 		 */
 		InstrEndLoop(queryDesc->totaltime);
 
-		if (DetectSeqScanOverLimit(queryDesc->planstate, NULL))
-		{
-			ExplainState *es = NewExplainState();
-
-			es->analyze = (queryDesc->instrument_options && pg_plan_watch_log_analyze);
-			es->verbose = pg_plan_watch_log_verbose;
-			es->buffers = (es->analyze && pg_plan_watch_log_buffers);
-			es->wal = (es->analyze && pg_plan_watch_log_wal);
-			es->timing = (es->analyze && pg_plan_watch_log_timing);
-			es->summary = es->analyze;
-			/* No support for MEMORY */
-			/* es->memory = false; */
-			es->format = pg_plan_watch_log_format;
-			es->settings = pg_plan_watch_log_settings;
-
-			ExplainBeginOutput(es);
-			ExplainQueryText(es, queryDesc);
-			ExplainQueryParameters(es, queryDesc->params, pg_plan_watch_log_parameter_max_length);
-			ExplainPrintPlan(es, queryDesc);
-			if (es->analyze && pg_plan_watch_log_triggers)
-				ExplainPrintTriggers(es, queryDesc);
-			if (es->costs)
-				ExplainPrintJITSummary(es, queryDesc);
-			ExplainEndOutput(es);
-
-			/* Remove last line break */
-			if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
-				es->str->data[--es->str->len] = '\0';
-
-			/* Fix JSON to output an object */
-			if (pg_plan_watch_log_format == EXPLAIN_FORMAT_JSON)
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.queryDesc = queryDesc;
+		ctx.sampled = current_query_sampled;
+
+		if (pg_plan_watch_log_wal_threshold >= 0)
+			DetectWalVolume(queryDesc, &ctx);
+
+		WatchPlanState(queryDesc->planstate, &ctx);
+
+		if (ctx.cost_samples != NIL)
+			FlushCostSamples(&ctx);
+
+		if (pg_plan_watch_log_result_rows_threshold >= 0 ||
+			pg_plan_watch_log_result_size_threshold >= 0)
+			DetectLargeResult(queryDesc, &ctx);
+
+		if (pg_plan_watch_log_first_row_threshold >= 0)
+			DetectFirstRowLatency(queryDesc, &ctx);
+
+		captured = (ctx.over_limit || ctx.findings != NIL);
+
+		if (ctx.sampled || captured)
+			RecordNodeHistory(queryDesc, &ctx, captured);
+
+		if (ctx.sampled)
+			RecordFoldedStacks(queryDesc);
+
+		if (captured)
+		{
+			char	   *plan = NULL;
+
+			if (pg_plan_watch_track_functions)
+				AttributeFunctionCalls(queryDesc, &ctx);
+			if (nesting_level > 0 && pg_plan_watch_log_nested_summary)
+				SummarizeNestedCapture(queryDesc, &ctx);
+			else
+				plan = LogPlan(queryDesc, &ctx);
+
+			if (pws_queue || pws_ring)
 			{
-				es->str->data[0] = '{';
-				es->str->data[es->str->len - 1] = '}';
+				if (plan == NULL)
+					plan = RenderPlan(queryDesc, &ctx);
+				if (pws_queue)
+					QueueCapture(queryDesc, plan);
+				if (pws_ring)
+					WriteCaptureFile(queryDesc, plan);
 			}
 
-			/*
-			 * Note: we rely on the existing logging of context or
-			 * debug_query_string to identify just which statement is being
-			 * reported.  This isn't ideal but trying to do it here would
-			 * often result in duplication.
-			 */
-			ereport(pg_plan_watch_log_level,
-					(errmsg("duration: %.3f ms  plan:\n%s",
-							queryDesc->totaltime->total * 1000.0, es->str->data),
-					 errhidestmt(true)));
+			if (pg_plan_watch_otlp_target[0] != '\0')
+				ExportPlanSpans(queryDesc);
 		}
 
 		MemoryContextSwitchTo(oldcxt);
 	}
 
+	if (nesting_level == 0)
+		EndTopLevelStatement();
+
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
@@ -421,20 +1674,3214 @@ explain_ExecutorEnd(QueryDesc *queryDesc)
 }
 
 /*
- * Return true if there is at least one plan node where the number of
- * returned tuples exceeds the configured threshold.
+ * ProcessUtility hook: statements run by DO and CALL are nested in them.
+ *
+ * Other utility commands run at most a query of their own, such as the
+ * query of EXPLAIN ANALYZE, CREATE TABLE AS or COPY, which is watched as a
+ * top-level statement.
  */
-static bool
-DetectSeqScanOverLimit(PlanState *planstate, void *context)
+static void
+pg_plan_watch_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							 bool readOnlyTree,
+							 ProcessUtilityContext context,
+							 ParamListInfo params, QueryEnvironment *queryEnv,
+							 DestReceiver *dest, QueryCompletion *qc)
 {
-	if (planstate->instrument)
-		InstrEndLoop(planstate->instrument);
+	Node	   *parsetree = pstmt->utilityStmt;
+	bool		nests;
 
-	/* Check this node */
-	if (planstate->instrument &&
-		planstate->instrument->ntuples >= pg_plan_watch_log_seqscan_threshold)
-		return true;
+	/*
+	 * Statements run by DO and CALL only count as nested when they are
+	 * being summarized.  Otherwise they stay top-level statements, watched
+	 * on their own as they always were.
+	 */
+	nests = (IsA(parsetree, DoStmt) || IsA(parsetree, CallStmt)) &&
+		pg_plan_watch_log_nested_statements &&
+		pg_plan_watch_log_nested_summary;
+
+	if (nests && nesting_level == 0)
+		SampleTopLevelStatement();
+
+	if (nests)
+		nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, readOnlyTree,
+								context, params, queryEnv,
+								dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree,
+									context, params, queryEnv,
+									dest, qc);
+	}
+	PG_FINALLY();
+	{
+		if (nests)
+			nesting_level--;
+	}
+	PG_END_TRY();
+
+	if (nests && nesting_level == 0)
+		EndTopLevelStatement();
+}
+
+/*
+ * At the beginning of each top-level statement, decide whether we'll sample
+ * this statement.  If nested-statement logging is enabled, nested
+ * statements will be sampled along with their parent.
+ */
+static void
+SampleTopLevelStatement(void)
+{
+	if (pg_plan_watch_sample_rate > 0 && !IsParallelWorker())
+		current_query_sampled =
+			(pg_prng_double(&pg_global_prng_state) < pg_plan_watch_sample_rate);
+	else
+		current_query_sampled = false;
+}
+
+/*
+ * The end of a top-level statement closes its nested executions and its
+ * nested summary.
+ */
+static void
+EndTopLevelStatement(void)
+{
+	if (pg_plan_watch_log_repeated_query_threshold >= 0)
+		ReportRepeatedQueries(true);
+
+	if (nested_summary)
+		LogNestedSummary();
+}
+
+/*
+ * Transaction callback: report the queries repeated within the transaction,
+ * and write out the captures buffered during it.
+ *
+ * The hash table itself goes away with TopTransactionContext.
+ */
+static void
+pg_plan_watch_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			if (repeated_queries)
+				ReportRepeatedQueries(false);
+			repeated_queries = NULL;
+
+			/* Left over by a top-level statement that failed */
+			if (nested_summary)
+				LogNestedSummary();
+
+			if (capture_batch)
+				FlushCaptureBatch();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Handler for the PLAN_WATCH option of EXPLAIN.
+ */
+static void
+plan_watch_explain_option(ExplainState *es, DefElem *opt, ParseState *pstate)
+{
+	PlanWatchExplainState *state = GetExplainExtensionState(es, es_extension_id);
+
+	if (state == NULL)
+	{
+		state = palloc0(sizeof(PlanWatchExplainState));
+		SetExplainExtensionState(es, es_extension_id, state);
+	}
+
+	state->enabled = defGetBoolean(opt);
+}
+
+/*
+ * explain_per_node_hook: with EXPLAIN (PLAN_WATCH), print the history of
+ * each plan node recorded from earlier executions of the same query, and
+ * the rules the node would trip.
+ *
+ * History is matched by queryId, plan fingerprint and plan_node_id.  The
+ * fingerprint is taken when the top node is explained.
+ */
+static void
+plan_watch_explain_per_node(PlanState *planstate, List *ancestors,
+							const char *relationship, const char *plan_name,
+							ExplainState *es)
+{
+	PlanWatchExplainState *state;
+	int64		queryid = planstate->state->es_plannedstmt->queryId;
+	pwsNodeEntry history = {0};
+	bool		have_history = false;
+	char	   *would_trip;
+
+	if (prev_explain_per_node_hook)
+		(*prev_explain_per_node_hook) (planstate, ancestors, relationship,
+									   plan_name, es);
+
+	state = GetExplainExtensionState(es, es_extension_id);
+	if (state == NULL || !state->enabled)
+		return;
+
+	if (ancestors == NIL)
+	{
+		uint64		planid = 0;
+
+		FingerprintPlanState(planstate, &planid);
+		state->planid = (int64) planid;
+		state->visited = NIL;
+	}
+	state->visited = lappend(state->visited, planstate);
+
+	if (pws && pws_node_hash && queryid != 0)
+	{
+		pwsNodeKey	key;
+		pwsNodeEntry *entry;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.queryid = queryid;
+		key.planid = state->planid;
+		key.plan_node_id = planstate->plan->plan_node_id;
+
+		LWLockAcquire(pws->lock, LW_SHARED);
+		entry = (pwsNodeEntry *) hash_search(pws_node_hash, &key,
+											 HASH_FIND, NULL);
+		if (entry)
+		{
+			history = *entry;
+			have_history = true;
+		}
+		LWLockRelease(pws->lock);
+	}
+
+	would_trip = DescribeWouldTrip(planstate,
+								   AncestorPlanStates(state, ancestors), es);
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		ExplainIndentText(es);
+		if (have_history)
+			appendStringInfo(es->str,
+							 "Plan Watch: flagged %lld of %lld executions, p95 rows %.0f, last captured %s\n",
+							 (long long) history.flagged,
+							 (long long) history.executions,
+							 pws_rows_percentile(&history, 0.95),
+							 history.last_capture != 0 ?
+							 timestamptz_to_str(history.last_capture) : "never");
+		else
+			appendStringInfoString(es->str, "Plan Watch: no history\n");
+
+		if (would_trip)
+		{
+			ExplainIndentText(es);
+			appendStringInfo(es->str, "Plan Watch Would Trip: %s\n",
+							 would_trip);
+		}
+		return;
+	}
+
+	ExplainOpenGroup("Plan Watch", "Plan Watch", true, es);
+	if (have_history)
+	{
+		ExplainPropertyInteger("Executions", NULL, history.executions, es);
+		ExplainPropertyInteger("Times Flagged", NULL, history.flagged, es);
+		ExplainPropertyFloat("P95 Rows", NULL,
+							 pws_rows_percentile(&history, 0.95), 0, es);
+		if (history.last_capture != 0)
+			ExplainPropertyText("Last Capture",
+								timestamptz_to_str(history.last_capture), es);
+	}
+	if (would_trip)
+		ExplainPropertyText("Would Trip", would_trip, es);
+	ExplainCloseGroup("Plan Watch", "Plan Watch", true, es);
+}
+
+/*
+ * Describe the configured rules that this plan node would trip, or return
+ * NULL if there are none.
+ *
+ * Only rules that can be judged on a single node are checked, with the same
+ * predicates as the detectors.  Without ANALYZE, only the seqscan threshold
+ * is checked, against the planner's row estimate.  ancestors are the
+ * PlanStates above the node, nearest last, as in PlanWatchContext.
+ */
+static char *
+DescribeWouldTrip(PlanState *planstate, List *ancestors, ExplainState *es)
+{
+	StringInfoData buf;
+
+	/* What the predicates report about the node; not shown here */
+	double		x;
+	double		y;
+	PlanState  *ps1;
+	PlanState  *ps2;
+	int			i1;
+	int			i2;
+	Oid			relid;
+	MemoizeInstrumentation stats;
+
+	initStringInfo(&buf);
+
+	if (!es->analyze)
+	{
+		if (pg_plan_watch_log_seqscan_threshold >= 0 &&
+			IsA(planstate, SeqScanState) &&
+			planstate->plan->plan_rows >= pg_plan_watch_log_seqscan_threshold)
+			appendStringInfoString(&buf, "seqscan_threshold (estimated)");
+	}
+	else
+	{
+		/* The nodes below this one are explained, and finished, after it */
+		FinishInstrumentation(planstate, NULL);
+
+		if (DetectSeqScanOverLimit(planstate))
+			appendStringInfoString(&buf, "seqscan_threshold");
+
+		foreach_node(SubPlanState, sps, planstate->subPlan)
+		{
+			if (SubPlanLoopsTrip(sps))
+				appendStringInfo(&buf, "%ssubplan_loops (%s)",
+								 buf.len > 0 ? ", " : "",
+								 sps->subplan->plan_name);
+		}
+
+		if (IsA(planstate, LimitState) &&
+			LimitWasteTrips((LimitState *) planstate, &x, &y, &ps1, &ps2))
+			appendStringInfo(&buf, "%slimit_waste", buf.len > 0 ? ", " : "");
+
+		if (TupleCostTrips(planstate, &x, &y))
+			appendStringInfo(&buf, "%stuple_cost", buf.len > 0 ? ", " : "");
+
+		if ((IsA(planstate, AppendState) || IsA(planstate, MergeAppendState)) &&
+			PartitionScansTrip(planstate, &i1, &i2, &relid))
+			appendStringInfo(&buf, "%spartitions", buf.len > 0 ? ", " : "");
+
+		if (IsA(planstate, MemoizeState) &&
+			MemoizeHitRatioTrips((MemoizeState *) planstate, &stats))
+			appendStringInfo(&buf, "%smemoize", buf.len > 0 ? ", " : "");
+
+		if (IsA(planstate, ForeignScanState) &&
+			ForeignPassThroughTrips((ForeignScanState *) planstate, ancestors,
+									&x, &y, &ps1))
+			appendStringInfo(&buf, "%sforeign_pass_through",
+							 buf.len > 0 ? ", " : "");
+
+		if (IsA(planstate, RecursiveUnionState) &&
+			RecursionTrips((RecursiveUnionState *) planstate, &x, &y))
+			appendStringInfo(&buf, "%srecursion", buf.len > 0 ? ", " : "");
+	}
+
+	if (buf.len == 0)
+	{
+		pfree(buf.data);
+		return NULL;
+	}
+
+	return buf.data;
+}
+
+/*
+ * Map the ancestors explain_per_node_hook gets, Plan nodes nearest first,
+ * to the PlanStates explained so far, nearest last.  The chain stops at a
+ * SubPlan.
+ */
+static List *
+AncestorPlanStates(PlanWatchExplainState *state, List *ancestors)
+{
+	List	   *result = NIL;
+
+	foreach_ptr(Node, ancestor, ancestors)
+	{
+		PlanState  *found = NULL;
+
+		foreach_ptr(PlanState, ps, state->visited)
+		{
+			if ((Node *) ps->plan == ancestor)
+			{
+				found = ps;
+				break;
+			}
+		}
+		if (found == NULL)
+			break;
+		result = lcons(found, result);
+	}
+
+	return result;
+}
+
+/*
+ * Finish the instrumentation of a subtree of a plan that is still being
+ * explained.  InstrEndLoop does nothing the second time, so this doesn't
+ * change what EXPLAIN shows for the nodes later on.
+ */
+static bool
+FinishInstrumentation(PlanState *planstate, void *context)
+{
+	if (planstate->instrument)
+		InstrEndLoop(planstate->instrument);
+
+	return planstate_tree_walker(planstate, FinishInstrumentation, context);
+}
+
+/*
+ * Count one more execution of a query in the current transaction.
+ */
+static void
+CountRepeatedQuery(QueryDesc *queryDesc)
+{
+	RepeatedQueryKey key;
+	RepeatedQueryEntry *entry;
+	bool		found;
+
+	if (pg_plan_watch_log_repeated_query_threshold < 0 || am_persist_worker)
+		return;
+
+	if (queryDesc->plannedstmt->queryId == 0 || IsParallelWorker() ||
+		(queryDesc->estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0)
+		return;
+
+	if (repeated_queries == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(RepeatedQueryKey);
+		ctl.entrysize = sizeof(RepeatedQueryEntry);
+		ctl.hcxt = TopTransactionContext;
+		repeated_queries = hash_create("pg_plan_watch repeated queries",
+									   64, &ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryDesc->plannedstmt->queryId;
+	key.nested = (nesting_level > 0);
+
+	entry = (RepeatedQueryEntry *) hash_search(repeated_queries, &key,
+											   HASH_FIND, NULL);
+	if (!entry)
+	{
+		/* Keep the table small; very diverse transactions are not N+1 */
+		if (hash_get_num_entries(repeated_queries) >= PW_MAX_REPEATED_QUERIES)
+			return;
+
+		entry = (RepeatedQueryEntry *) hash_search(repeated_queries, &key,
+												   HASH_ENTER, &found);
+		entry->calls = 0;
+		entry->total_time = 0;
+	}
+
+	entry->calls++;
+	if (queryDesc->totaltime)
+	{
+		InstrEndLoop(queryDesc->totaltime);
+		entry->total_time += queryDesc->totaltime->total * 1000.0;
+	}
+}
+
+/*
+ * Log the queries executed at least log_repeated_query_threshold times, and
+ * forget about them.  If nested_only is true, only the executions nested in
+ * the top-level statement that just ended are considered.
+ */
+static void
+ReportRepeatedQueries(bool nested_only)
+{
+	HASH_SEQ_STATUS hash_seq;
+	RepeatedQueryEntry *entry;
+
+	if (repeated_queries == NULL)
+		return;
+
+	hash_seq_init(&hash_seq, repeated_queries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (nested_only && !entry->key.nested)
+			continue;
+
+		if (entry->calls >= pg_plan_watch_log_repeated_query_threshold)
+		{
+			double		counters[2];
+
+			ereport(pg_plan_watch_log_level,
+					(errmsg("query %lld executed %lld times in one %s, total duration: %.3f ms",
+							(long long) entry->key.queryid,
+							(long long) entry->calls,
+							nested_only ? "statement" : "transaction",
+							entry->total_time),
+					 errhidestmt(true)));
+
+			counters[0] = entry->calls;
+			counters[1] = entry->total_time;
+			pws_accum(PWS_KIND_REPEATED_QUERY, entry->key.queryid,
+					  InvalidOid, InvalidOid, -1, NULL,
+					  counters, lengthof(counters));
+		}
+
+		if (nested_only)
+			hash_search(repeated_queries, &entry->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Find the state of a running query, optionally creating it.
+ */
+static PlanWatchQueryState *
+GetQueryState(QueryDesc *queryDesc, bool create)
+{
+	PlanWatchQueryState *qstate;
+	dlist_iter	iter;
+
+	dlist_foreach(iter, &active_queries)
+	{
+		qstate = dlist_container(PlanWatchQueryState, node, iter.cur);
+		if (qstate->queryDesc == queryDesc)
+			return qstate;
+	}
+
+	if (!create)
+		return NULL;
+
+	qstate = MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+									sizeof(PlanWatchQueryState));
+	qstate->queryDesc = queryDesc;
+	qstate->cb.func = ReleaseQueryState;
+	qstate->cb.arg = qstate;
+	MemoryContextRegisterResetCallback(queryDesc->estate->es_query_cxt,
+									   &qstate->cb);
+	dlist_push_head(&active_queries, &qstate->node);
+
+	return qstate;
+}
+
+/*
+ * Memory context callback: forget the state of a query that is going away.
+ */
+static void
+ReleaseQueryState(void *arg)
+{
+	PlanWatchQueryState *qstate = (PlanWatchQueryState *) arg;
+
+	dlist_delete(&qstate->node);
+}
+
+/*
+ * FirstRowReceiver callbacks
+ */
+static bool
+first_row_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	FirstRowReceiver *receiver = (FirstRowReceiver *) self;
+	PlanWatchQueryState *qstate = receiver->qstate;
+
+	if (!qstate->first_row_seen)
+	{
+		instr_time	now;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, qstate->run_start);
+		qstate->first_row_time = INSTR_TIME_GET_MILLISEC(now);
+		qstate->first_row_seen = true;
+	}
+
+	return receiver->target->receiveSlot(slot, receiver->target);
+}
+
+static void
+first_row_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	FirstRowReceiver *receiver = (FirstRowReceiver *) self;
+
+	receiver->target->rStartup(receiver->target, operation, typeinfo);
+}
+
+static void
+first_row_shutdown(DestReceiver *self)
+{
+	FirstRowReceiver *receiver = (FirstRowReceiver *) self;
+
+	receiver->target->rShutdown(receiver->target);
+}
+
+static void
+first_row_destroy(DestReceiver *self)
+{
+	FirstRowReceiver *receiver = (FirstRowReceiver *) self;
+
+	receiver->target->rDestroy(receiver->target);
+}
+
+/*
+ * needs_fmgr_hook: route calls of user-defined functions through
+ * pg_plan_watch_fmgr_hook, while a tracked query is being initialized, and
+ * calls of procedural functions while callers are tracked
+ *
+ * SQL functions are left out of the latter on purpose: the planner doesn't
+ * inline functions that need the hook, and we must not change plans.
+ */
+static bool
+pg_plan_watch_needs_fmgr_hook(Oid fn_oid)
+{
+	Oid			lang;
+
+	if (prev_needs_fmgr_hook && (*prev_needs_fmgr_hook) (fn_oid))
+		return true;
+
+	if (fn_oid < FirstNormalObjectId)
+		return false;
+
+	if (function_tracking_active)
+		return true;
+
+	if (!pg_plan_watch_track_callers)
+		return false;
+
+	lang = get_func_lang(fn_oid);
+	return lang != INTERNALlanguageId && lang != ClanguageId &&
+		lang != SQLlanguageId;
+}
+
+/*
+ * fmgr_hook: count the calls and time of user-defined functions
+ *
+ * The calls are charged to the query whose per-query memory context the
+ * FmgrInfo was set up in.  Functions hooked on behalf of another module are
+ * not found there, and are ignored.  We don't use *arg, which is shared
+ * with any other module hooking the same function.
+ */
+static void
+pg_plan_watch_fmgr_hook(FmgrHookEventType event,
+						FmgrInfo *flinfo, Datum *arg)
+{
+	PlanWatchQueryState *qstate = NULL;
+	FunctionUsage *usage;
+	dlist_iter	iter;
+	bool		found;
+
+	if (prev_fmgr_hook)
+		(*prev_fmgr_hook) (event, flinfo, arg);
+
+	/*
+	 * Keep track of the user-defined functions being executed, whoever
+	 * hooked them.  This is done regardless of track_callers, so that the
+	 * stack stays balanced if the setting changes during a call.
+	 */
+	if (flinfo->fn_oid >= FirstNormalObjectId)
+	{
+		switch (event)
+		{
+			case FHET_START:
+				if (caller_depth < PW_MAX_CALLER_DEPTH)
+					caller_stack[caller_depth] = flinfo->fn_oid;
+				caller_depth++;
+				break;
+
+			case FHET_END:
+			case FHET_ABORT:
+				if (caller_depth > 0)
+					caller_depth--;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	dlist_foreach(iter, &active_queries)
+	{
+		PlanWatchQueryState *cur = dlist_container(PlanWatchQueryState,
+												   node, iter.cur);
+
+		if (cur->queryDesc->estate->es_query_cxt == flinfo->fn_mcxt)
+		{
+			qstate = cur;
+			break;
+		}
+	}
+	if (qstate == NULL)
+		return;
+
+	if (qstate->function_usage == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(FunctionUsage);
+		ctl.hcxt = qstate->queryDesc->estate->es_query_cxt;
+		qstate->function_usage = hash_create("pg_plan_watch function usage",
+											 16, &ctl,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	usage = (FunctionUsage *) hash_search(qstate->function_usage,
+										  &flinfo->fn_oid, HASH_ENTER, &found);
+	if (!found)
+	{
+		usage->calls = 0;
+		usage->total_time = 0;
+		usage->depth = 0;
+	}
+
+	switch (event)
+	{
+		case FHET_START:
+			usage->calls++;
+			if (usage->depth++ == 0)
+				INSTR_TIME_SET_CURRENT(usage->start);
+			break;
+
+		case FHET_END:
+		case FHET_ABORT:
+			if (usage->depth > 0 && --usage->depth == 0)
+			{
+				instr_time	now;
+
+				INSTR_TIME_SET_CURRENT(now);
+				INSTR_TIME_SUBTRACT(now, usage->start);
+				usage->total_time += INSTR_TIME_GET_MILLISEC(now);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Add a finding for each user-defined function called by the quals or the
+ * target list of a plan node of a query being logged.
+ *
+ * Calls are counted per function, not per call site; a function called by
+ * several nodes is reported with the same figures for each of them.
+ */
+static void
+AttributeFunctionCalls(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	PlanWatchQueryState *qstate = GetQueryState(queryDesc, false);
+
+	if (qstate == NULL || qstate->function_usage == NULL)
+		return;
+
+	ctx->function_usage = qstate->function_usage;
+	AttributeNodeFunctionCalls(queryDesc->planstate, ctx);
+}
+
+static bool
+AttributeNodeFunctionCalls(PlanState *planstate, void *context)
+{
+	PlanWatchContext *ctx = (PlanWatchContext *) context;
+	List	   *qual_funcs = NIL;
+	List	   *output_funcs = NIL;
+
+	CollectFunctionIds((Node *) planstate->plan->qual, &qual_funcs);
+	CollectFunctionIds((Node *) planstate->plan->targetlist, &output_funcs);
+
+	foreach_oid(funcid, list_concat_unique_oid(list_copy(qual_funcs),
+											   output_funcs))
+	{
+		FunctionUsage *usage;
+
+		usage = (FunctionUsage *) hash_search(ctx->function_usage, &funcid,
+											  HASH_FIND, NULL);
+		if (usage == NULL || usage->calls == 0 || get_func_name(funcid) == NULL)
+			continue;
+
+		AddFinding(ctx, "function_calls", planstate,
+				   "%s: %s calls %s %lld times, %.3f ms",
+				   DescribePlanNode(planstate),
+				   list_member_oid(qual_funcs, funcid) ? "Filter" : "Output",
+				   get_func_name(funcid),
+				   (long long) usage->calls, usage->total_time);
+	}
+
+	return planstate_tree_walker(planstate, AttributeNodeFunctionCalls, context);
+}
+
+/*
+ * Render the plan of a query that tripped one of the detectors, in the
+ * configured format, together with the findings.
+ */
+static char *
+RenderPlan(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	ExplainState *es = NewExplainState();
+
+	es->analyze = (queryDesc->instrument_options && pg_plan_watch_log_analyze);
+	es->verbose = (pg_plan_watch_log_verbose || ctx->force_verbose);
+	es->buffers = (es->analyze && pg_plan_watch_log_buffers);
+	es->wal = (es->analyze && pg_plan_watch_log_wal);
+	es->timing = (es->analyze && pg_plan_watch_log_timing);
+	es->summary = es->analyze;
+	/* No support for MEMORY */
+	/* es->memory = false; */
+	es->format = pg_plan_watch_log_format;
+	es->settings = pg_plan_watch_log_settings;
+
+	ExplainBeginOutput(es);
+	ExplainQueryText(es, queryDesc);
+	ExplainQueryParameters(es, queryDesc->params, pg_plan_watch_log_parameter_max_length);
+	ExplainPrintCaller(es);
+	ExplainPrintPlan(es, queryDesc);
+	if (es->analyze && pg_plan_watch_log_triggers)
+		ExplainPrintTriggers(es, queryDesc);
+	if (es->costs)
+		ExplainPrintJITSummary(es, queryDesc);
+	ExplainPrintFindings(es, ctx->findings);
+	ExplainEndOutput(es);
+
+	/* Remove last line break */
+	if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+		es->str->data[--es->str->len] = '\0';
+
+	/* Fix JSON to output an object */
+	if (pg_plan_watch_log_format == EXPLAIN_FORMAT_JSON)
+	{
+		es->str->data[0] = '{';
+		es->str->data[es->str->len - 1] = '}';
+	}
+
+	return es->str->data;
+}
+
+/*
+ * Log the plan of a query that tripped one of the detectors.  Returns the
+ * rendered plan.
+ */
+static char *
+LogPlan(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	char	   *plan = RenderPlan(queryDesc, ctx);
+
+	/*
+	 * Note: we rely on the existing logging of context or
+	 * debug_query_string to identify just which statement is being
+	 * reported.  This isn't ideal but trying to do it here would
+	 * often result in duplication.
+	 */
+	if (pg_plan_watch_log_batch_size < 0)
+		ereport(pg_plan_watch_log_level,
+				(errmsg("duration: %.3f ms  plan:\n%s",
+						queryDesc->totaltime->total * 1000.0, plan),
+				 errhidestmt(true)));
+	else
+		WriteCapture(psprintf("duration: %.3f ms  plan:\n%s",
+							  queryDesc->totaltime->total * 1000.0, plan));
+
+	return plan;
+}
+
+/*
+ * Add a nested capture to the summary of the current top-level statement.
+ *
+ * Inner plans are told apart by queryId and by a fingerprint of the plan
+ * shape, so the plan is only rendered the first time it is seen.
+ */
+static void
+SummarizeNestedCapture(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	NestedSummaryKey key;
+	NestedSummaryEntry *entry;
+	bool		found;
+
+	if (nested_summary == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (nested_summary_cxt == NULL)
+			nested_summary_cxt = AllocSetContextCreate(TopMemoryContext,
+													   "pg_plan_watch nested summary",
+													   ALLOCSET_DEFAULT_SIZES);
+
+		ctl.keysize = sizeof(NestedSummaryKey);
+		ctl.entrysize = sizeof(NestedSummaryEntry);
+		ctl.hcxt = nested_summary_cxt;
+		nested_summary = hash_create("pg_plan_watch nested summary",
+									 32, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryDesc->plannedstmt->queryId;
+	FingerprintPlanState(queryDesc->planstate, &key.fingerprint);
+
+	entry = (NestedSummaryEntry *) hash_search(nested_summary, &key,
+											   HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		StringInfoData detectors;
+
+		if (hash_get_num_entries(nested_summary) >= PW_NESTED_SUMMARY_MAX_PLANS)
+		{
+			nested_summary_overflow++;
+			return;
+		}
+
+		initStringInfo(&detectors);
+		if (ctx->over_limit)
+			appendStringInfoString(&detectors, "seqscan_threshold");
+		foreach_ptr(PlanWatchFinding, finding, ctx->findings)
+		{
+			if (strstr(detectors.data, finding->detector) != NULL)
+				continue;
+			if (detectors.len > 0)
+				appendStringInfoString(&detectors, ", ");
+			appendStringInfoString(&detectors, finding->detector);
+		}
+
+		entry = (NestedSummaryEntry *) hash_search(nested_summary, &key,
+												   HASH_ENTER, &found);
+		entry->seq = hash_get_num_entries(nested_summary);
+		entry->captures = 0;
+		entry->rows = 0;
+		entry->total_time = 0;
+		entry->detectors = MemoryContextStrdup(nested_summary_cxt,
+											   detectors.data);
+		entry->plan = MemoryContextStrdup(nested_summary_cxt,
+										  RenderPlan(queryDesc, ctx));
+	}
+
+	entry->captures++;
+	entry->rows += queryDesc->estate->es_processed;
+	entry->total_time += queryDesc->totaltime->total * 1000.0;
+}
+
+/*
+ * Log the summary of the nested captures, in order of first capture, and
+ * start a new one.
+ */
+static void
+LogNestedSummary(void)
+{
+	NestedSummaryEntry **entries;
+	NestedSummaryEntry *entry;
+	HASH_SEQ_STATUS hash_seq;
+	StringInfoData buf;
+	int			nentries = hash_get_num_entries(nested_summary);
+	int64		captures = nested_summary_overflow;
+
+	entries = palloc0(sizeof(NestedSummaryEntry *) * nentries);
+	hash_seq_init(&hash_seq, nested_summary);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[entry->seq - 1] = entry;
+		captures += entry->captures;
+	}
+
+	initStringInfo(&buf);
+	for (int i = 0; i < nentries; i++)
+	{
+		entry = entries[i];
+		appendStringInfo(&buf,
+						 "\nnested plan %d: captures: %lld  rows: %.0f  duration: %.3f ms  flagged by: %s\n%s",
+						 i + 1, (long long) entry->captures, entry->rows,
+						 entry->total_time, entry->detectors, entry->plan);
+	}
+	if (nested_summary_overflow > 0)
+		appendStringInfo(&buf, "\n%lld more captures of other plans were not summarized",
+						 (long long) nested_summary_overflow);
+
+	WriteCapture(psprintf("nested statements: %lld captures of %d distinct plans%s",
+						  (long long) captures, nentries, buf.data));
+
+	pfree(buf.data);
+	pfree(entries);
+
+	MemoryContextReset(nested_summary_cxt);
+	nested_summary = NULL;
+	nested_summary_overflow = 0;
+}
+
+/*
+ * Log a rendered capture, or add it to the transaction's batch.
+ */
+static void
+WriteCapture(const char *capture)
+{
+	MemoryContext oldcxt;
+
+	if (pg_plan_watch_log_batch_size < 0)
+	{
+		ereport(pg_plan_watch_log_level,
+				(errmsg_internal("%s", capture),
+				 errhidestmt(true)));
+		return;
+	}
+
+	if (capture_batch_cxt == NULL)
+		capture_batch_cxt = AllocSetContextCreate(TopMemoryContext,
+												  "pg_plan_watch capture batch",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	oldcxt = MemoryContextSwitchTo(capture_batch_cxt);
+	if (capture_batch == NULL)
+	{
+		capture_batch = makeStringInfo();
+		capture_batch_start = GetCurrentTimestamp();
+	}
+	capture_batch_count++;
+	appendStringInfo(capture_batch, "\ncapture %d: %s",
+					 capture_batch_count, capture);
+	MemoryContextSwitchTo(oldcxt);
+
+	if (capture_batch->len >= pg_plan_watch_log_batch_size * 1024L ||
+		(pg_plan_watch_log_batch_max_age >= 0 &&
+		 TimestampDifferenceExceeds(capture_batch_start, GetCurrentTimestamp(),
+									pg_plan_watch_log_batch_max_age)))
+		FlushCaptureBatch();
+}
+
+/*
+ * Write the buffered captures as a single log entry, and start a new batch.
+ */
+static void
+FlushCaptureBatch(void)
+{
+	StringInfo	batch = capture_batch;
+	int			count = capture_batch_count;
+
+	/* Forget the batch first, so that an error here cannot repeat it */
+	capture_batch = NULL;
+	capture_batch_count = 0;
+
+	ereport(pg_plan_watch_log_level,
+			(errmsg("%d captured plans:%s", count, batch->data),
+			 errhidestmt(true)));
+
+	MemoryContextReset(capture_batch_cxt);
+}
+
+/*
+ * Compute a fingerprint of the shape of a plan: its node types and the
+ * relations scanned.  Always returns false, so that the whole tree is
+ * visited.
+ */
+static bool
+FingerprintPlanState(PlanState *planstate, void *context)
+{
+	uint64	   *fingerprint = (uint64 *) context;
+	Plan	   *plan = planstate->plan;
+
+	/* EXPLAIN doesn't show invisible Gather nodes; skip them likewise */
+	if (IsA(plan, Gather) && ((Gather *) plan)->invisible)
+		return planstate_tree_walker(planstate, FingerprintPlanState, context);
+
+	*fingerprint = hash_combine64(*fingerprint, (uint64) nodeTag(plan));
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_TidRangeScan:
+		case T_ForeignScan:
+			{
+				Index		scanrelid = ((Scan *) plan)->scanrelid;
+
+				if (scanrelid > 0)
+					*fingerprint = hash_combine64(*fingerprint,
+												  (uint64) rt_fetch(scanrelid, planstate->state->es_range_table)->relid);
+			}
+			break;
+		default:
+			break;
+	}
+
+	planstate_tree_walker(planstate, FingerprintPlanState, context);
+
+	return false;
+}
+
+/*
+ * Print where a nested or function-run statement comes from: its nesting
+ * level, the top-level query, and the innermost user-defined function.
+ */
+static void
+ExplainPrintCaller(ExplainState *es)
+{
+	Oid			caller = pg_plan_watch_track_callers ? CurrentCaller() : InvalidOid;
+
+	if (nesting_level == 0 && !OidIsValid(caller))
+		return;
+
+	ExplainPropertyInteger("Nesting Level", NULL, nesting_level, es);
+	ExplainPropertyInteger("Top-Level Query Identifier", NULL,
+						   pgstat_get_my_query_id(), es);
+	if (OidIsValid(caller))
+	{
+		ExplainPropertyText(get_func_rettype(caller) == TRIGGEROID ?
+							"Calling Trigger Function" : "Calling Function",
+							format_procedure(caller), es);
+		ExplainPropertyUInteger("Calling Function OID", NULL, caller, es);
+	}
+}
+
+/*
+ * Print the detectors' findings after the plan.
+ */
+static void
+ExplainPrintFindings(ExplainState *es, List *findings)
+{
+	if (findings == NIL)
+		return;
+
+	ExplainOpenGroup("Plan Watch", "Plan Watch", false, es);
+
+	foreach_ptr(PlanWatchFinding, finding, findings)
+	{
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+		{
+			ExplainIndentText(es);
+			appendStringInfo(es->str, "Plan Watch [%s]: %s\n",
+							 finding->detector, finding->detail);
+			continue;
+		}
+
+		ExplainOpenGroup("Finding", NULL, true, es);
+		ExplainPropertyText("Detector", finding->detector, es);
+		if (finding->plan_node_id >= 0)
+			ExplainPropertyInteger("Plan Node Id", NULL,
+								   finding->plan_node_id, es);
+		ExplainPropertyText("Detail", finding->detail, es);
+		ExplainCloseGroup("Finding", NULL, true, es);
+	}
+
+	ExplainCloseGroup("Plan Watch", "Plan Watch", false, es);
+}
+
+/*
+ * Record a finding about the given plan node (or about the whole query, if
+ * planstate is NULL).  Any finding causes the plan to be logged.
+ */
+static void
+AddFinding(PlanWatchContext *ctx, const char *detector, PlanState *planstate,
+		   const char *fmt,...)
+{
+	PlanWatchFinding *finding;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	for (;;)
+	{
+		va_list		args;
+		int			needed;
+
+		va_start(args, fmt);
+		needed = appendStringInfoVA(&buf, fmt, args);
+		va_end(args);
+		if (needed == 0)
+			break;
+		enlargeStringInfo(&buf, needed);
+	}
+
+	finding = palloc(sizeof(PlanWatchFinding));
+	finding->detector = detector;
+	finding->plan_node_id = planstate ? planstate->plan->plan_node_id : -1;
+	finding->detail = buf.data;
+
+	ctx->findings = lappend(ctx->findings, finding);
+}
+
+/*
+ * Walk the plan state tree, finishing per-node instrumentation and running
+ * the detectors.  Children are visited before their parent, so detectors
+ * can rely on the instrumentation of the whole subtree being complete.
+ * Always returns false, so that the whole tree is visited.
+ */
+static bool
+WatchPlanState(PlanState *planstate, void *context)
+{
+	PlanWatchContext *ctx = (PlanWatchContext *) context;
+
+	if (planstate->instrument)
+		InstrEndLoop(planstate->instrument);
+
+	ctx->ancestors = lappend(ctx->ancestors, planstate);
+	planstate_tree_walker(planstate, WatchPlanState, context);
+	ctx->ancestors = list_delete_last(ctx->ancestors);
+
+	/* Each detector checks whether its rule is enabled itself */
+	if (planstate->subPlan != NIL)
+		DetectSubPlanLoops(planstate, ctx);
+
+	if (IsA(planstate, LimitState))
+		DetectLimitWaste((LimitState *) planstate, ctx);
+
+	DetectTupleCost(planstate, ctx);
+
+	if (IsA(planstate, AppendState) || IsA(planstate, MergeAppendState))
+		DetectPartitionScans(planstate, ctx);
+
+	if (IsA(planstate, MemoizeState))
+		DetectMemoizeEfficiency((MemoizeState *) planstate, ctx);
+
+	if (IsA(planstate, ForeignScanState))
+		DetectForeignPassThrough((ForeignScanState *) planstate, ctx);
+
+	if (IsA(planstate, RecursiveUnionState))
+		DetectRecursionExplosion((RecursiveUnionState *) planstate, ctx);
+
+	if (ctx->wal_flagged && IsA(planstate, ModifyTableState))
+		AccumModifyTableWal((ModifyTableState *) planstate, ctx);
+
+	if (ctx->sampled &&
+		(IsA(planstate, SeqScanState) || IsA(planstate, IndexScanState)))
+		CollectCostSample((ScanState *) planstate, ctx);
+
+	if (DetectSeqScanOverLimit(planstate))
+	{
+		ctx->over_limit = true;
+
+		DetectSeqScanBloat((ScanState *) planstate, ctx);
+
+		if (pg_plan_watch_track_callers)
+			AccumSeqScanCaller((ScanState *) planstate, ctx);
+
+		if (pg_plan_watch_metrics_target[0] != '\0')
+			SendSeqScanMetric((ScanState *) planstate,
+							  ctx->queryDesc->plannedstmt->queryId);
+	}
+
+	return false;
+}
+
+/*
+ * Return true if this plan node is a sequential scan and the number of
+ * tuples it returned exceeds the configured threshold.
+ */
+static bool
+DetectSeqScanOverLimit(PlanState *planstate)
+{
+	return pg_plan_watch_log_seqscan_threshold >= 0 &&
+		IsA(planstate, SeqScanState) &&
+		planstate->instrument &&
+		planstate->instrument->ntuples >= pg_plan_watch_log_seqscan_threshold;
+}
+
+/*
+ * Estimate how much of a flagged sequential scan was spent reading dead
+ * tuples, using the cumulative statistics of the relation.
+ *
+ * The dead fraction reported by n_live_tup/n_dead_tup is applied to the
+ * number of heap blocks the scan read.  That is taken from the buffer usage
+ * of the node when available, and otherwise assumed to be the whole
+ * relation for each loop.
+ */
+static void
+DetectSeqScanBloat(ScanState *node, PlanWatchContext *ctx)
+{
+	Relation	rel = node->ss_currentRelation;
+	Instrumentation *instr = node->ps.instrument;
+	PgStat_StatTabEntry *tabentry;
+	double		live;
+	double		dead;
+	double		dead_fraction;
+	double		blocks;
+	double		rows_examined;
+	double		wasted;
+	double		counters[3];
+
+	if (rel == NULL)
+		return;
+
+	tabentry = pgstat_fetch_stat_tabentry(RelationGetRelid(rel));
+	if (tabentry == NULL)
+		return;
+
+	live = (double) tabentry->live_tuples;
+	dead = (double) tabentry->dead_tuples;
+	if (live + dead <= 0)
+		return;
+	dead_fraction = dead / (live + dead);
+
+	if (instr->need_bufusage)
+		blocks = (double) (instr->bufusage.shared_blks_hit +
+						   instr->bufusage.shared_blks_read +
+						   instr->bufusage.local_blks_hit +
+						   instr->bufusage.local_blks_read);
+	else
+		blocks = (double) RelationGetNumberOfBlocks(rel) * instr->nloops;
+
+	rows_examined = instr->ntuples + instr->nfiltered1;
+	wasted = blocks * dead_fraction;
+
+	if (dead > 0)
+		AddFinding(ctx, "seqscan_bloat", &node->ps,
+				   "Seq Scan on %s: %.0f%% dead tuples (n_live_tup=%.0f, n_dead_tup=%.0f), about %.0f of %.0f heap blocks read were wasted, %.0f rows examined",
+				   RelationGetRelationName(rel),
+				   dead_fraction * 100.0, live, dead,
+				   wasted, blocks, rows_examined);
+
+	counters[0] = blocks;
+	counters[1] = wasted;
+	counters[2] = rows_examined;
+	pws_accum(PWS_KIND_SEQSCAN_BLOAT, 0, RelationGetRelid(rel), InvalidOid,
+			  -1, NULL, counters, lengthof(counters));
+}
+
+/*
+ * Accumulate a flagged sequential scan under the top-level query and the
+ * function it was run for, so that the scans of a relation can be broken
+ * down by caller.
+ */
+static void
+AccumSeqScanCaller(ScanState *node, PlanWatchContext *ctx)
+{
+	Instrumentation *instr = node->ps.instrument;
+	Oid			caller = CurrentCaller();
+	double		counters[3];
+
+	if (node->ss_currentRelation == NULL || instr == NULL)
+		return;
+
+	counters[0] = instr->nloops;
+	counters[1] = instr->ntuples + instr->nfiltered1;
+	counters[2] = instr->need_timer ? instr->total * 1000.0 : 0;
+	pws_accum(PWS_KIND_SEQSCAN_CALLER, pgstat_get_my_query_id(),
+			  RelationGetRelid(node->ss_currentRelation), caller, -1, NULL,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Flag the correlated SubPlans of a node that were executed more often than
+ * log_subplan_loops_threshold.
+ *
+ * Each SubPlan is executed once per row of the node whose expressions
+ * reference it, so the rows examined by its scans add up across loops.  The
+ * finding names both the SubPlan and the node that drives it.
+ */
+static void
+DetectSubPlanLoops(PlanState *planstate, PlanWatchContext *ctx)
+{
+	foreach_node(SubPlanState, sps, planstate->subPlan)
+	{
+		Instrumentation *instr = sps->planstate->instrument;
+		double		rows_examined = 0;
+		double		counters[3];
+
+		if (!SubPlanLoopsTrip(sps))
+			continue;
+
+		SumLeafRows(sps->planstate, &rows_examined);
+
+		AddFinding(ctx, "subplan_loops", sps->planstate,
+				   "%s executed %.0f times by %s, examining %.0f rows across loops (%.0f per loop)%s",
+				   sps->subplan->plan_name,
+				   instr->nloops,
+				   DescribePlanNode(planstate),
+				   rows_examined,
+				   rows_examined / instr->nloops,
+				   instr->need_timer ?
+				   psprintf(", %.3f ms", instr->total * 1000.0) : "");
+
+		counters[0] = instr->nloops;
+		counters[1] = rows_examined;
+		counters[2] = instr->total * 1000.0;
+		pws_accum(PWS_KIND_SUBPLAN, ctx->queryDesc->plannedstmt->queryId,
+				  InvalidOid, InvalidOid, sps->planstate->plan->plan_node_id, NULL,
+				  counters, lengthof(counters));
+	}
+}
+
+/*
+ * Was a SubPlan executed more often than log_subplan_loops_threshold?
+ */
+static bool
+SubPlanLoopsTrip(SubPlanState *sps)
+{
+	Instrumentation *instr = sps->planstate->instrument;
+
+	return pg_plan_watch_log_subplan_loops_threshold >= 0 &&
+		instr != NULL &&
+		instr->nloops >= pg_plan_watch_log_subplan_loops_threshold;
+}
+
+/*
+ * Add up the rows examined by the leaf nodes of a subtree, i.e. the rows
+ * its scans returned plus those they filtered out.
+ */
+static bool
+SumLeafRows(PlanState *planstate, void *context)
+{
+	double	   *rows = (double *) context;
+
+	if (!PlanStateHasChildren(planstate) && planstate->instrument)
+		*rows += planstate->instrument->ntuples +
+			planstate->instrument->nfiltered1 +
+			planstate->instrument->nfiltered2;
+
+	return planstate_tree_walker(planstate, SumLeafRows, context);
+}
+
+/*
+ * Does a plan node have child plan nodes?  Besides the outer and inner
+ * plans, some nodes keep their children in lists of their own, as
+ * planstate_tree_walker knows.  SubPlans in expressions don't count.
+ */
+static bool
+PlanStateHasChildren(PlanState *planstate)
+{
+	switch (nodeTag(planstate))
+	{
+		case T_AppendState:
+			return ((AppendState *) planstate)->as_nplans > 0;
+		case T_MergeAppendState:
+			return ((MergeAppendState *) planstate)->ms_nplans > 0;
+		case T_BitmapAndState:
+			return ((BitmapAndState *) planstate)->nplans > 0;
+		case T_BitmapOrState:
+			return ((BitmapOrState *) planstate)->nplans > 0;
+		case T_SubqueryScanState:
+			return true;
+		case T_CustomScanState:
+			if (((CustomScanState *) planstate)->custom_ps != NIL)
+				return true;
+			break;
+		default:
+			break;
+	}
+
+	return outerPlanState(planstate) != NULL ||
+		innerPlanState(planstate) != NULL;
+}
+
+/*
+ * Flag a query that sent more rows, or more bytes, to the client than the
+ * configured thresholds.  The size is estimated from the planned width of
+ * the result rows.  Findings are summed per queryId and application_name.
+ */
+static void
+DetectLargeResult(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	CommandDest dest = queryDesc->dest->mydest;
+	uint64		rows = queryDesc->estate->es_processed;
+	int			width = queryDesc->planstate->plan->plan_width;
+	double		bytes = (double) rows * width;
+	double		counters[2];
+
+	if (queryDesc->operation != CMD_SELECT ||
+		(dest != DestRemote && dest != DestRemoteExecute &&
+		 dest != DestRemoteSimple))
+		return;
+
+	if (!(pg_plan_watch_log_result_rows_threshold >= 0 &&
+		  rows >= (uint64) pg_plan_watch_log_result_rows_threshold) &&
+		!(pg_plan_watch_log_result_size_threshold >= 0 &&
+		  bytes >= (double) pg_plan_watch_log_result_size_threshold * 1024))
+		return;
+
+	AddFinding(ctx, "large_result", NULL,
+			   "%llu rows of about %d bytes each (%.0f kB) sent to application \"%s\"",
+			   (unsigned long long) rows, width, bytes / 1024,
+			   application_name ? application_name : "");
+
+	counters[0] = (double) rows;
+	counters[1] = bytes;
+	pws_accum(PWS_KIND_LARGE_RESULT, queryDesc->plannedstmt->queryId,
+			  InvalidOid, InvalidOid, -1, application_name,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Flag a query that generated more WAL than log_wal_threshold, using the
+ * WAL usage of the whole statement, triggers included.
+ */
+static void
+DetectWalVolume(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	WalUsage   *walusage = &queryDesc->totaltime->walusage;
+	double		counters[3];
+
+	if (walusage->wal_bytes < (uint64) pg_plan_watch_log_wal_threshold * 1024)
+		return;
+
+	ctx->wal_flagged = true;
+
+	AddFinding(ctx, "wal", NULL,
+			   "query generated %llu bytes of WAL in %lld records, %lld of them full page images",
+			   (unsigned long long) walusage->wal_bytes,
+			   (long long) walusage->wal_records,
+			   (long long) walusage->wal_fpi);
+
+	counters[0] = (double) walusage->wal_records;
+	counters[1] = (double) walusage->wal_fpi;
+	counters[2] = (double) walusage->wal_bytes;
+	pws_accum(PWS_KIND_WAL, queryDesc->plannedstmt->queryId,
+			  InvalidOid, InvalidOid, -1, NULL, counters, lengthof(counters));
+}
+
+/*
+ * Attribute the WAL generated below a ModifyTable node of a flagged query to
+ * the relation it modifies (the partitioned table, for partitions).
+ */
+static void
+AccumModifyTableWal(ModifyTableState *node, PlanWatchContext *ctx)
+{
+	ModifyTable *plan = (ModifyTable *) node->ps.plan;
+	Instrumentation *instr = node->ps.instrument;
+	RangeTblEntry *rte;
+	double		counters[3];
+
+	if (instr == NULL || !instr->need_walusage ||
+		instr->walusage.wal_bytes == 0 || plan->nominalRelation == 0)
+		return;
+
+	rte = rt_fetch(plan->nominalRelation, node->ps.state->es_range_table);
+	if (rte->rtekind != RTE_RELATION)
+		return;
+
+	counters[0] = (double) instr->walusage.wal_records;
+	counters[1] = (double) instr->walusage.wal_fpi;
+	counters[2] = (double) instr->walusage.wal_bytes;
+	pws_accum(PWS_KIND_WAL, ctx->queryDesc->plannedstmt->queryId,
+			  rte->relid, InvalidOid, node->ps.plan->plan_node_id, NULL,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Flag a query whose first row took longer than log_first_row_threshold to
+ * be sent, and name the blocking nodes that must consume their whole input
+ * before producing a row.  With timing instrumentation, their time to first
+ * tuple is given too.
+ */
+static void
+DetectFirstRowLatency(QueryDesc *queryDesc, PlanWatchContext *ctx)
+{
+	PlanWatchQueryState *qstate = GetQueryState(queryDesc, false);
+	StringInfoData blocking;
+
+	if (qstate == NULL || !qstate->first_row_seen ||
+		qstate->first_row_time < pg_plan_watch_log_first_row_threshold)
+		return;
+
+	initStringInfo(&blocking);
+	CollectBlockingNodes(queryDesc->planstate, &blocking);
+
+	AddFinding(ctx, "first_row", NULL,
+			   "first row sent after %.3f ms; blocking nodes: %s",
+			   qstate->first_row_time,
+			   blocking.len > 0 ? blocking.data : "none");
+}
+
+/*
+ * Append a description of each blocking node of a plan to a string.
+ */
+static bool
+CollectBlockingNodes(PlanState *planstate, void *context)
+{
+	StringInfo	buf = (StringInfo) context;
+	bool		blocking;
+
+	switch (nodeTag(planstate))
+	{
+		case T_SortState:
+		case T_IncrementalSortState:
+		case T_HashState:
+		case T_MaterialState:
+			blocking = true;
+			break;
+		case T_AggState:
+			blocking = (((Agg *) planstate->plan)->aggstrategy != AGG_SORTED);
+			break;
+		default:
+			blocking = false;
+			break;
+	}
+
+	if (blocking)
+	{
+		Instrumentation *instr = planstate->instrument;
+
+		if (buf->len > 0)
+			appendStringInfoString(buf, ", ");
+		appendStringInfoString(buf, DescribePlanNode(planstate));
+		if (instr && instr->need_timer && instr->nloops > 0)
+			appendStringInfo(buf, " (startup %.3f ms)",
+							 1000.0 * instr->startup / instr->nloops);
+	}
+
+	return planstate_tree_walker(planstate, CollectBlockingNodes, context);
+}
+
+/*
+ * Don't judge the cost per tuple of nodes that processed fewer tuples than
+ * this; their figures are dominated by startup and timer overhead.
+ */
+#define PW_TUPLE_COST_MIN_TUPLES	1000
+
+/*
+ * Flag a plan node whose own time per tuple processed exceeds
+ * log_tuple_cost_threshold, and name the functions called by its quals and
+ * target list, which are the usual culprits.
+ *
+ * The node's own time is its total time less that of its children,
+ * SubPlans included.  The tuples processed are those it returned plus
+ * those its quals filtered out.
+ */
+static void
+DetectTupleCost(PlanState *planstate, PlanWatchContext *ctx)
+{
+	Plan	   *plan = planstate->plan;
+	double		self_time;
+	double		tuples;
+	double		counters[2];
+
+	if (!TupleCostTrips(planstate, &tuples, &self_time))
+		return;
+
+	AddFinding(ctx, "tuple_cost", planstate,
+			   "%s spent %.0f ns per tuple over %.0f tuples (%.3f ms); filter calls: %s; output calls: %s",
+			   DescribePlanNode(planstate), self_time * 1e9 / tuples, tuples,
+			   self_time * 1000.0,
+			   DescribeCalledFunctions(plan->qual),
+			   DescribeCalledFunctions(plan->targetlist));
+
+	counters[0] = tuples;
+	counters[1] = self_time * 1000.0;
+	pws_accum(PWS_KIND_TUPLE_COST, ctx->queryDesc->plannedstmt->queryId,
+			  InvalidOid, InvalidOid, plan->plan_node_id, NULL,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Did a timed plan node spend log_tuple_cost_threshold or more of its own
+ * time per tuple processed?  Sets the tuples processed and the node's own
+ * time, in seconds.
+ */
+static bool
+TupleCostTrips(PlanState *planstate, double *tuples, double *self_time)
+{
+	Instrumentation *instr = planstate->instrument;
+	double		child_time = 0;
+
+	if (pg_plan_watch_log_tuple_cost_threshold < 0 ||
+		instr == NULL || !instr->need_timer)
+		return false;
+
+	*tuples = instr->ntuples + instr->nfiltered1 + instr->nfiltered2;
+	if (*tuples < PW_TUPLE_COST_MIN_TUPLES)
+		return false;
+
+	planstate_tree_walker(planstate, SumChildTime, &child_time);
+	*self_time = Max(instr->total - child_time, 0);
+
+	return *self_time * 1e9 / *tuples >= pg_plan_watch_log_tuple_cost_threshold;
+}
+
+/*
+ * Add the total time of a child node to *context; does not recurse.
+ */
+static bool
+SumChildTime(PlanState *planstate, void *context)
+{
+	if (planstate->instrument)
+		*(double *) context += planstate->instrument->total;
+
+	return false;
+}
+
+/*
+ * List the distinct functions called by some expressions, as a string.
+ */
+static char *
+DescribeCalledFunctions(List *exprs)
+{
+	List	   *funcids = NIL;
+	StringInfoData buf;
+
+	CollectFunctionIds((Node *) exprs, &funcids);
+	if (funcids == NIL)
+		return "none";
+
+	initStringInfo(&buf);
+	foreach_oid(funcid, funcids)
+	{
+		char	   *name = get_func_name(funcid);
+
+		if (buf.len > 0)
+			appendStringInfoString(&buf, ", ");
+		appendStringInfoString(&buf, name ? name : "?");
+	}
+
+	return buf.data;
+}
+
+/*
+ * Expression tree walker collecting the OIDs of the functions called, by
+ * function call syntax or through an operator.
+ */
+static bool
+CollectFunctionIds(Node *node, List **funcids)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, FuncExpr))
+		*funcids = list_append_unique_oid(*funcids,
+										  ((FuncExpr *) node)->funcid);
+	else if (IsA(node, OpExpr) || IsA(node, DistinctExpr) ||
+			 IsA(node, NullIfExpr))
+		*funcids = list_append_unique_oid(*funcids,
+										  ((OpExpr *) node)->opfuncid);
+	else if (IsA(node, ScalarArrayOpExpr))
+		*funcids = list_append_unique_oid(*funcids,
+										  ((ScalarArrayOpExpr *) node)->opfuncid);
+
+	return expression_tree_walker(node, CollectFunctionIds, funcids);
+}
+
+/*
+ * Flag an Append or MergeAppend node over a partitioned table that scanned
+ * more partitions than log_partitions_threshold, or a larger fraction of
+ * them than log_partitions_fraction.
+ *
+ * A partition counts as scanned if its subplan was executed at all.  The
+ * finding tells how many partitions survived each stage of pruning: at plan
+ * time, at executor startup (initial pruning) and during execution.
+ */
+static void
+DetectPartitionScans(PlanState *planstate, PlanWatchContext *ctx)
+{
+	int			nsubplans;
+	int			nplanned;
+	int			part_prune_index;
+	Oid			relid;
+	int			scanned;
+	int			total;
+	double		counters[2];
+
+	if (!PartitionScansTrip(planstate, &scanned, &total, &relid))
+		return;
+
+	if (IsA(planstate, AppendState))
+	{
+		Append	   *plan = (Append *) planstate->plan;
+
+		nsubplans = ((AppendState *) planstate)->as_nplans;
+		nplanned = list_length(plan->appendplans);
+		part_prune_index = plan->part_prune_index;
+	}
+	else
+	{
+		MergeAppend *plan = (MergeAppend *) planstate->plan;
+
+		nsubplans = ((MergeAppendState *) planstate)->ms_nplans;
+		nplanned = list_length(plan->mergeplans);
+		part_prune_index = plan->part_prune_index;
+	}
+
+	AddFinding(ctx, "partitions", planstate,
+			   "%s scanned %d of %d partitions of %s (%.0f%%); %d left after plan-time pruning, %d after initial pruning, run-time pruning %s",
+			   DescribePlanNode(planstate), scanned, total,
+			   get_rel_name(relid), 100.0 * scanned / total,
+			   nplanned, nsubplans,
+			   part_prune_index >= 0 ? "available" : "not available");
+
+	counters[0] = scanned;
+	counters[1] = total;
+	pws_accum(PWS_KIND_PARTITIONS, ctx->queryDesc->plannedstmt->queryId,
+			  relid, InvalidOid, -1, NULL, counters, lengthof(counters));
+}
+
+/*
+ * Did an Append or MergeAppend node over a partitioned table scan more
+ * partitions than the configured limits?  Sets the partitions scanned, the
+ * leaf partitions of the table and the table's OID.
+ */
+static bool
+PartitionScansTrip(PlanState *planstate, int *scanned, int *total, Oid *relid)
+{
+	PlanState **subplans;
+	int			nsubplans;
+	Bitmapset  *apprelids;
+	RangeTblEntry *rte;
+	int			rti;
+	Relation	rel;
+
+	if (pg_plan_watch_log_partitions_threshold < 0 &&
+		pg_plan_watch_log_partitions_fraction < 0)
+		return false;
+
+	if (IsA(planstate, AppendState))
+	{
+		subplans = ((AppendState *) planstate)->appendplans;
+		nsubplans = ((AppendState *) planstate)->as_nplans;
+		apprelids = ((Append *) planstate->plan)->apprelids;
+	}
+	else
+	{
+		subplans = ((MergeAppendState *) planstate)->mergeplans;
+		nsubplans = ((MergeAppendState *) planstate)->ms_nplans;
+		apprelids = ((MergeAppend *) planstate->plan)->apprelids;
+	}
+
+	/* Only interested in scans of partitioned tables */
+	rti = bms_next_member(apprelids, -1);
+	if (rti <= 0)
+		return false;
+	rte = rt_fetch(rti, planstate->state->es_range_table);
+	if (rte->rtekind != RTE_RELATION ||
+		rte->relkind != RELKIND_PARTITIONED_TABLE)
+		return false;
+	*relid = rte->relid;
+
+	*scanned = 0;
+	for (int i = 0; i < nsubplans; i++)
+	{
+		if (subplans[i]->instrument && subplans[i]->instrument->nloops > 0)
+			(*scanned)++;
+	}
+
+	if (pg_plan_watch_log_partitions_threshold < 0 ||
+		*scanned < pg_plan_watch_log_partitions_threshold)
+	{
+		if (pg_plan_watch_log_partitions_fraction < 0 || *scanned == 0)
+			return false;
+	}
+
+	/* The executor holds a lock on the table */
+	rel = relation_open(rte->relid, NoLock);
+	*total = CountLeafPartitions(rel);
+	relation_close(rel, NoLock);
+	if (*total == 0)
+		return false;
+
+	return (pg_plan_watch_log_partitions_threshold >= 0 &&
+			*scanned >= pg_plan_watch_log_partitions_threshold) ||
+		(pg_plan_watch_log_partitions_fraction >= 0 &&
+		 *scanned >= pg_plan_watch_log_partitions_fraction * *total);
+}
+
+/*
+ * Count the leaf partitions of a partitioned table from its partition
+ * descriptor, without a catalog lookup per partition.
+ *
+ * This runs in ExecutorEnd, so no new locks are taken: the caller holds a
+ * lock on the table, and a sub-partitioned partition is only descended
+ * into if the query already locked it.  One that wasn't (e.g. pruned at
+ * plan time) counts as a single partition, so the result is then a lower
+ * bound.
+ */
+static int
+CountLeafPartitions(Relation rel)
+{
+	PartitionDesc partdesc = RelationGetPartitionDesc(rel, true);
+	int			total = 0;
+
+	check_stack_depth();
+
+	for (int i = 0; i < partdesc->nparts; i++)
+	{
+		Relation	child;
+
+		if (partdesc->is_leaf[i] ||
+			!CheckRelationOidLockedByMe(partdesc->oids[i], AccessShareLock,
+										true))
+		{
+			total++;
+			continue;
+		}
+
+		child = relation_open(partdesc->oids[i], NoLock);
+		total += CountLeafPartitions(child);
+		relation_close(child, NoLock);
+	}
+
+	return total;
+}
+
+/*
+ * Don't judge Memoize nodes that did fewer cache lookups than this.
+ */
+#define PW_MEMOIZE_MIN_LOOKUPS	100
+
+/*
+ * Flag a Memoize node whose cache hit ratio is below log_memoize_hit_ratio;
+ * such a cache costs more in lookups, evictions and memory than it saves.
+ * The statistics of parallel workers are added to the leader's.
+ */
+static void
+DetectMemoizeEfficiency(MemoizeState *node, PlanWatchContext *ctx)
+{
+	MemoizeInstrumentation stats;
+	double		counters[5];
+
+	if (!MemoizeHitRatioTrips(node, &stats))
+		return;
+
+	AddFinding(ctx, "memoize", &node->ss.ps,
+			   "%s hit ratio %.1f%%: " UINT64_FORMAT " hits, " UINT64_FORMAT " misses, " UINT64_FORMAT " evictions, " UINT64_FORMAT " overflows, peak memory " UINT64_FORMAT " kB",
+			   DescribePlanNode(&node->ss.ps),
+			   100.0 * stats.cache_hits / (stats.cache_hits + stats.cache_misses),
+			   stats.cache_hits, stats.cache_misses,
+			   stats.cache_evictions, stats.cache_overflows,
+			   (stats.mem_peak + 1023) / 1024);
+
+	counters[0] = (double) stats.cache_hits;
+	counters[1] = (double) stats.cache_misses;
+	counters[2] = (double) stats.cache_evictions;
+	counters[3] = (double) stats.cache_overflows;
+	counters[4] = (double) stats.mem_peak;
+	pws_accum(PWS_KIND_MEMOIZE, ctx->queryDesc->plannedstmt->queryId,
+			  InvalidOid, InvalidOid, node->ss.ps.plan->plan_node_id, NULL,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Was the cache hit ratio of a Memoize node below log_memoize_hit_ratio?
+ * Sets the cache statistics, those of parallel workers included.
+ */
+static bool
+MemoizeHitRatioTrips(MemoizeState *node, MemoizeInstrumentation *stats)
+{
+	double		lookups;
+
+	if (pg_plan_watch_log_memoize_hit_ratio < 0)
+		return false;
+
+	*stats = node->stats;
+
+	/*
+	 * mem_peak is only set once the cache has evicted; as in EXPLAIN, the
+	 * memory in use is the peak otherwise.
+	 */
+	if (stats->mem_peak == 0)
+		stats->mem_peak = node->mem_used;
+
+	if (node->shared_info)
+	{
+		for (int n = 0; n < node->shared_info->num_workers; n++)
+		{
+			MemoizeInstrumentation *si = &node->shared_info->sinstrument[n];
+
+			stats->cache_hits += si->cache_hits;
+			stats->cache_misses += si->cache_misses;
+			stats->cache_evictions += si->cache_evictions;
+			stats->cache_overflows += si->cache_overflows;
+			stats->mem_peak = Max(stats->mem_peak, si->mem_peak);
+		}
+	}
+
+	lookups = (double) (stats->cache_hits + stats->cache_misses);
+	if (lookups < PW_MEMOIZE_MIN_LOOKUPS)
+		return false;
+
+	return stats->cache_hits / lookups < pg_plan_watch_log_memoize_hit_ratio;
+}
+
+/*
+ * Don't judge foreign scans that fetched fewer rows than this.
+ */
+#define PW_FOREIGN_MIN_ROWS		1000
+
+/*
+ * Flag a foreign scan whose rows are mostly thrown away locally, which
+ * suggests that quals or joins could not be pushed down to the remote
+ * server.
+ *
+ * The rows fetched are those the scan returned plus those its local quals
+ * removed.  The rows surviving are those returned by the topmost of the
+ * joins directly above the scan, looking through nodes that only pass rows
+ * along, or by the scan itself if there is no such join.
+ */
+static void
+DetectForeignPassThrough(ForeignScanState *node, PlanWatchContext *ctx)
+{
+	PlanState  *survivor;
+	double		fetched;
+	double		surviving;
+
+	if (!ForeignPassThroughTrips(node, ctx->ancestors,
+								 &fetched, &surviving, &survivor))
+		return;
+
+	AddFinding(ctx, "foreign_pass_through", &node->ss.ps,
+			   "%s fetched %.0f rows, of which %.0f (%.2f%%) survived %s",
+			   DescribePlanNode(&node->ss.ps), fetched, surviving,
+			   100.0 * surviving / fetched,
+			   survivor == &node->ss.ps ? "its local filter" :
+			   psprintf("up to %s", DescribePlanNode(survivor)));
+
+	ctx->force_verbose = true;
+}
+
+/*
+ * Did fewer than log_foreign_pass_ratio of the rows fetched by a foreign
+ * scan survive?  ancestors are the nodes above the scan, nearest last.
+ * Sets the rows fetched and surviving, and the node they survived up to.
+ */
+static bool
+ForeignPassThroughTrips(ForeignScanState *node, List *ancestors,
+						double *fetched, double *surviving,
+						PlanState **survivor)
+{
+	Instrumentation *instr = node->ss.ps.instrument;
+
+	if (pg_plan_watch_log_foreign_pass_ratio < 0 || instr == NULL)
+		return false;
+
+	*fetched = instr->ntuples + instr->nfiltered1;
+	if (*fetched < PW_FOREIGN_MIN_ROWS)
+		return false;
+
+	*survivor = &node->ss.ps;
+	for (int i = list_length(ancestors) - 1; i >= 0; i--)
+	{
+		PlanState  *parent = (PlanState *) list_nth(ancestors, i);
+		bool		pass_through = true;
+
+		switch (nodeTag(parent))
+		{
+			case T_NestLoopState:
+			case T_HashJoinState:
+			case T_MergeJoinState:
+				if (parent->instrument)
+					*survivor = parent;
+				break;
+			case T_HashState:
+			case T_MaterialState:
+			case T_MemoizeState:
+			case T_SortState:
+			case T_IncrementalSortState:
+			case T_GatherState:
+			case T_GatherMergeState:
+				break;
+			default:
+				pass_through = false;
+				break;
+		}
+		if (!pass_through)
+			break;
+	}
+
+	*surviving = Min((*survivor)->instrument->ntuples, *fetched);
+
+	return *surviving / *fetched < pg_plan_watch_log_foreign_pass_ratio;
+}
+
+/*
+ * Flag a recursive query that iterated, or produced intermediate rows, more
+ * than the configured limits.
+ *
+ * The recursive term of a RecursiveUnion is rescanned once per iteration,
+ * WorkTable Scan included, so its loop count is the number of iterations,
+ * i.e. the recursion depth reached.  The rows it returned across all
+ * iterations are the intermediate rows that went through the work table.
+ * Per-loop counts of the work table scan never show any of this.
+ */
+static void
+DetectRecursionExplosion(RecursiveUnionState *node, PlanWatchContext *ctx)
+{
+	PlanState  *nonrecursive = outerPlanState(node);
+	double		iterations;
+	double		rows;
+	double		counters[3];
+
+	if (!RecursionTrips(node, &iterations, &rows))
+		return;
+
+	AddFinding(ctx, "recursion", &node->ps,
+			   "Recursive Union iterated %.0f times (recursion depth %.0f), the recursive term produced %.0f intermediate rows from %.0f initial rows, %.0f rows returned",
+			   iterations, iterations, rows,
+			   nonrecursive && nonrecursive->instrument ?
+			   nonrecursive->instrument->ntuples : 0,
+			   node->ps.instrument ? node->ps.instrument->ntuples : 0);
+
+	counters[0] = iterations;
+	counters[1] = rows;
+	counters[2] = iterations;
+	pws_accum(PWS_KIND_RECURSION, ctx->queryDesc->plannedstmt->queryId,
+			  InvalidOid, InvalidOid, node->ps.plan->plan_node_id, NULL,
+			  counters, lengthof(counters));
+}
+
+/*
+ * Did a RecursiveUnion iterate, or produce intermediate rows, beyond the
+ * configured limits?  Sets the iterations and intermediate rows.
+ */
+static bool
+RecursionTrips(RecursiveUnionState *node, double *iterations, double *rows)
+{
+	PlanState  *recursive = innerPlanState(node);
+
+	if ((pg_plan_watch_log_recursion_depth_threshold < 0 &&
+		 pg_plan_watch_log_recursion_rows_threshold < 0) ||
+		recursive == NULL || recursive->instrument == NULL)
+		return false;
+
+	*iterations = recursive->instrument->nloops;
+	*rows = recursive->instrument->ntuples;
+
+	return (pg_plan_watch_log_recursion_depth_threshold >= 0 &&
+			*iterations >= pg_plan_watch_log_recursion_depth_threshold) ||
+		(pg_plan_watch_log_recursion_rows_threshold >= 0 &&
+		 *rows >= pg_plan_watch_log_recursion_rows_threshold);
+}
+
+/*
+ * Flag a Limit node that returned far fewer rows than were read below it.
+ *
+ * Two patterns are recognized: a deep OFFSET, where the Limit itself reads
+ * and discards rows from its child, and Limit -> Sort -> Seq Scan, where
+ * the whole table is read and sorted to return the first few rows.  In the
+ * latter case an index on the sort key would let the scan stop early.
+ */
+static void
+DetectLimitWaste(LimitState *node, PlanWatchContext *ctx)
+{
+	PlanState  *sort;
+	PlanState  *scan;
+	double		returned;
+	double		consumed;
+
+	if (!LimitWasteTrips(node, &returned, &consumed, &sort, &scan))
+		return;
+
+	if (scan)
+		AddFinding(ctx, "limit_waste", &node->ps,
+				   "Limit returned %.0f of %.0f rows sorted from %s (%.1f rows read per row returned); an index on %s would allow the scan to stop early",
+				   returned, consumed, DescribePlanNode(scan),
+				   consumed / Max(returned, 1),
+				   DescribeSortKeys((Sort *) sort->plan, scan));
+	else
+		AddFinding(ctx, "limit_waste", &node->ps,
+				   "Limit returned %.0f of %.0f rows read from %s with OFFSET " INT64_FORMAT " (%.1f rows read per row returned)",
+				   returned, consumed, DescribePlanNode(outerPlanState(node)),
+				   node->offset,
+				   consumed / Max(returned, 1));
+}
+
+/*
+ * Did a Limit node discard at least log_limit_wasted_rows of the rows read
+ * below it?  Sets the rows returned and read, and, for a top-N sort over a
+ * sequential scan, the Sort and scan nodes; *scan is NULL otherwise.
+ */
+static bool
+LimitWasteTrips(LimitState *node, double *returned, double *consumed,
+				PlanState **sort, PlanState **scan)
+{
+	PlanState  *child = outerPlanState(node);
+
+	*scan = NULL;
+
+	if (pg_plan_watch_log_limit_wasted_rows < 0 ||
+		node->ps.instrument == NULL || child == NULL || child->instrument == NULL)
+		return false;
+
+	*returned = node->ps.instrument->ntuples;
+	*consumed = child->instrument->ntuples;
+
+	/* Look for a top-N sort over a sequential scan, maybe below Gather Merge */
+	*sort = child;
+	if (IsA(*sort, GatherMergeState))
+		*sort = outerPlanState(*sort);
+	if (*sort && IsA(*sort, SortState) &&
+		outerPlanState(*sort) && IsA(outerPlanState(*sort), SeqScanState) &&
+		outerPlanState(*sort)->instrument)
+	{
+		*scan = outerPlanState(*sort);
+		*consumed = Max(*consumed, (*scan)->instrument->ntuples);
+	}
+
+	return *consumed - *returned >= pg_plan_watch_log_limit_wasted_rows;
+}
+
+/*
+ * Describe the sort key of a Sort node over a scan, as "orders (a, b)".
+ * Keys that are not plain columns of the scanned relation are shown as "?".
+ */
+static char *
+DescribeSortKeys(Sort *sort, PlanState *scan)
+{
+	Index		scanrelid = ((Scan *) scan->plan)->scanrelid;
+	RangeTblEntry *rte = rt_fetch(scanrelid, scan->state->es_range_table);
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%s (", get_rel_name(rte->relid));
+
+	for (int i = 0; i < sort->numCols; i++)
+	{
+		TargetEntry *tle = get_tle_by_resno(scan->plan->targetlist,
+											sort->sortColIdx[i]);
+		char	   *attname = NULL;
+
+		if (tle && IsA(tle->expr, Var) &&
+			((Var *) tle->expr)->varno == scanrelid)
+			attname = get_attname(rte->relid, ((Var *) tle->expr)->varattno,
+								  true);
+
+		if (i > 0)
+			appendStringInfoString(&buf, ", ");
+		appendStringInfoString(&buf, attname ? attname : "?");
+	}
+
+	appendStringInfoChar(&buf, ')');
+
+	return buf.data;
+}
+
+/*
+ * Return a short description of a plan node, such as "Seq Scan on orders",
+ * to be used in findings.
+ */
+char *
+DescribePlanNode(PlanState *planstate)
+{
+	Plan	   *plan = planstate->plan;
+	Index		scanrelid;
+	const char *name = PlanNodeName(plan, &scanrelid);
+
+	if (scanrelid > 0)
+	{
+		RangeTblEntry *rte = rt_fetch(scanrelid,
+									  planstate->state->es_range_table);
+
+		if (rte->rtekind == RTE_RELATION)
+			return psprintf("%s on %s", name, get_rel_name(rte->relid));
+	}
+
+	return psprintf("%s (node %d)", name, plan->plan_node_id);
+}
+
+/*
+ * Return the name EXPLAIN gives a plan node, without its "Parallel" or
+ * "Partial" prefix, and set *scanrelid to the relation it scans or
+ * modifies, or 0.
+ */
+static const char *
+PlanNodeName(Plan *plan, Index *scanrelid)
+{
+	const char *name;
+
+	*scanrelid = 0;
+
+	switch (nodeTag(plan))
+	{
+		case T_Result:
+			name = "Result";
+			break;
+		case T_ProjectSet:
+			name = "ProjectSet";
+			break;
+		case T_ModifyTable:
+			switch (((ModifyTable *) plan)->operation)
+			{
+				case CMD_INSERT:
+					name = "Insert";
+					break;
+				case CMD_UPDATE:
+					name = "Update";
+					break;
+				case CMD_DELETE:
+					name = "Delete";
+					break;
+				case CMD_MERGE:
+					name = "Merge";
+					break;
+				default:
+					name = "ModifyTable";
+					break;
+			}
+			*scanrelid = ((ModifyTable *) plan)->nominalRelation;
+			break;
+		case T_Append:
+			name = "Append";
+			break;
+		case T_MergeAppend:
+			name = "Merge Append";
+			break;
+		case T_RecursiveUnion:
+			name = "Recursive Union";
+			break;
+		case T_NestLoop:
+			name = "Nested Loop";
+			break;
+		case T_MergeJoin:
+			name = "Merge Join";
+			break;
+		case T_HashJoin:
+			name = "Hash Join";
+			break;
+		case T_BitmapAnd:
+			name = "BitmapAnd";
+			break;
+		case T_BitmapOr:
+			name = "BitmapOr";
+			break;
+		case T_SeqScan:
+			name = "Seq Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_SampleScan:
+			name = "Sample Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_IndexScan:
+			name = "Index Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_IndexOnlyScan:
+			name = "Index Only Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_BitmapIndexScan:
+			name = "Bitmap Index Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_BitmapHeapScan:
+			name = "Bitmap Heap Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_TidScan:
+			name = "Tid Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_TidRangeScan:
+			name = "Tid Range Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_ForeignScan:
+			name = "Foreign Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_CustomScan:
+			name = "Custom Scan";
+			*scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_SubqueryScan:
+			name = "Subquery Scan";
+			break;
+		case T_FunctionScan:
+			name = "Function Scan";
+			break;
+		case T_TableFuncScan:
+			name = "Table Function Scan";
+			break;
+		case T_ValuesScan:
+			name = "Values Scan";
+			break;
+		case T_CteScan:
+			name = "CTE Scan";
+			break;
+		case T_NamedTuplestoreScan:
+			name = "Named Tuplestore Scan";
+			break;
+		case T_WorkTableScan:
+			name = "WorkTable Scan";
+			break;
+		case T_Gather:
+			name = "Gather";
+			break;
+		case T_GatherMerge:
+			name = "Gather Merge";
+			break;
+		case T_Material:
+			name = "Materialize";
+			break;
+		case T_Memoize:
+			name = "Memoize";
+			break;
+		case T_Sort:
+			name = "Sort";
+			break;
+		case T_IncrementalSort:
+			name = "Incremental Sort";
+			break;
+		case T_Group:
+			name = "Group";
+			break;
+		case T_Agg:
+			switch (((Agg *) plan)->aggstrategy)
+			{
+				case AGG_SORTED:
+					name = "GroupAggregate";
+					break;
+				case AGG_HASHED:
+					name = "HashAggregate";
+					break;
+				case AGG_MIXED:
+					name = "MixedAggregate";
+					break;
+				default:
+					name = "Aggregate";
+					break;
+			}
+			break;
+		case T_WindowAgg:
+			name = "WindowAgg";
+			break;
+		case T_Unique:
+			name = "Unique";
+			break;
+		case T_SetOp:
+			if (((SetOp *) plan)->strategy == SETOP_HASHED)
+				name = "HashSetOp";
+			else
+				name = "SetOp";
+			break;
+		case T_LockRows:
+			name = "LockRows";
+			break;
+		case T_Limit:
+			name = "Limit";
+			break;
+		case T_Hash:
+			name = "Hash";
+			break;
+		default:
+			name = "plan node";
+			break;
+	}
+
+	return name;
+}
+
+/*
+ * Add a sampled scan node to the query's cost calibration sums for its
+ * tablespace.  They are merged into the shared ones by FlushCostSamples,
+ * once per query.
+ *
+ * Every page read by a Seq Scan counts as a sequential page and every page
+ * read by an Index Scan as a random one, whether found in shared buffers or
+ * not, which is also how the planner charges them.
+ */
+static void
+CollectCostSample(ScanState *node, PlanWatchContext *ctx)
+{
+	Relation	rel = node->ss_currentRelation;
+	Instrumentation *instr = node->ps.instrument;
+	double		x[PWS_CALIB_NVARS];
+	double		y;
+	double		pages;
+	Oid			spcid;
+	pwsCalibEntry *sample = NULL;
+
+	if (!pws || !pws_calib_hash || IsParallelWorker())
+		return;
+
+	if (rel == NULL || instr == NULL ||
+		!instr->need_timer || !instr->need_bufusage || instr->nloops <= 0)
+		return;
+
+	pages = (double) (instr->bufusage.shared_blks_hit +
+					  instr->bufusage.shared_blks_read);
+	y = instr->total * 1000.0;
+	if (pages <= 0 || y <= 0)
+		return;
+
+	x[PWS_CALIB_SEQ_PAGES] = IsA(node, SeqScanState) ? pages : 0;
+	x[PWS_CALIB_RANDOM_PAGES] = IsA(node, SeqScanState) ? 0 : pages;
+	x[PWS_CALIB_TUPLES] = instr->ntuples + instr->nfiltered1;
+
+	spcid = rel->rd_rel->reltablespace;
+	if (!OidIsValid(spcid))
+		spcid = MyDatabaseTableSpace;
+
+	foreach_ptr(pwsCalibEntry, cur, ctx->cost_samples)
+	{
+		if (cur->spcid == spcid)
+		{
+			sample = cur;
+			break;
+		}
+	}
+	if (sample == NULL)
+	{
+		sample = palloc0(sizeof(pwsCalibEntry));
+		sample->spcid = spcid;
+		ctx->cost_samples = lappend(ctx->cost_samples, sample);
+	}
+
+	sample->samples++;
+	for (int i = 0; i < PWS_CALIB_NVARS; i++)
+	{
+		for (int j = 0; j < PWS_CALIB_NVARS; j++)
+			sample->xtx[i][j] += x[i] * x[j];
+		sample->xty[i] += x[i] * y;
+	}
+	sample->yty += y * y;
+}
+
+/*
+ * Merge the cost calibration sums collected for a query into the shared
+ * ones.
+ */
+static void
+FlushCostSamples(PlanWatchContext *ctx)
+{
+	LWLockAcquire(pws->lock, LW_EXCLUSIVE);
+
+	foreach_ptr(pwsCalibEntry, sample, ctx->cost_samples)
+	{
+		pwsCalibEntry *entry;
+		bool		found;
+
+		entry = (pwsCalibEntry *) hash_search(pws_calib_hash, &sample->spcid,
+											  HASH_FIND, NULL);
+		if (!entry &&
+			hash_get_num_entries(pws_calib_hash) < PWS_CALIB_MAX_TABLESPACES)
+		{
+			entry = (pwsCalibEntry *) hash_search(pws_calib_hash, &sample->spcid,
+												  HASH_ENTER, &found);
+			if (!found)
+				memset((char *) entry + sizeof(Oid), 0,
+					   sizeof(pwsCalibEntry) - sizeof(Oid));
+		}
+
+		if (!entry)
+			continue;
+
+		entry->samples += sample->samples;
+		for (int i = 0; i < PWS_CALIB_NVARS; i++)
+		{
+			for (int j = 0; j < PWS_CALIB_NVARS; j++)
+				entry->xtx[i][j] += sample->xtx[i][j];
+			entry->xty[i] += sample->xty[i];
+		}
+		entry->yty += sample->yty;
+	}
+
+	LWLockRelease(pws->lock);
+}
+
+/*
+ * Record the plan nodes of a sampled or captured query in the per-node
+ * statistics.  A node counts as flagged if a detector reported it.
+ */
+static void
+RecordNodeHistory(QueryDesc *queryDesc, PlanWatchContext *ctx, bool captured)
+{
+	int64		queryid = queryDesc->plannedstmt->queryId;
+	uint64		planid = 0;
+	List	   *nodes = NIL;
+	List	   *descriptions = NIL;
+	List	   *flagged = NIL;
+	ListCell   *lc1;
+	ListCell   *lc2;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (!pws || !pws_node_hash || IsParallelWorker() || queryid == 0 ||
+		(queryDesc->estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0)
+		return;
+
+	FingerprintPlanState(queryDesc->planstate, &planid);
+	CollectPlanNodes(queryDesc->planstate, &nodes);
+
+	/* Do the catalog lookups before taking the lock */
+	foreach_ptr(PlanState, planstate, nodes)
+		descriptions = lappend(descriptions, DescribePlanNode(planstate));
+
+	foreach_ptr(PlanWatchFinding, finding, ctx->findings)
+	{
+		if (finding->plan_node_id >= 0)
+			flagged = list_append_unique_int(flagged, finding->plan_node_id);
+	}
+
+	LWLockAcquire(pws->lock, LW_EXCLUSIVE);
+
+	forboth(lc1, nodes, lc2, descriptions)
+	{
+		PlanState  *planstate = (PlanState *) lfirst(lc1);
+		Instrumentation *instr = planstate->instrument;
+		pwsNodeKey	key;
+		pwsNodeEntry *entry;
+		bool		found;
+		int			bucket;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.queryid = queryid;
+		key.planid = (int64) planid;
+		key.plan_node_id = planstate->plan->plan_node_id;
+
+		entry = (pwsNodeEntry *) hash_search(pws_node_hash, &key,
+											 HASH_FIND, NULL);
+		if (!entry &&
+			hash_get_num_entries(pws_node_hash) < pg_plan_watch_max_nodes)
+		{
+			entry = (pwsNodeEntry *) hash_search(pws_node_hash, &key,
+												 HASH_ENTER, &found);
+			if (!found)
+			{
+				memset((char *) entry + sizeof(pwsNodeKey), 0,
+					   sizeof(pwsNodeEntry) - sizeof(pwsNodeKey));
+				strlcpy(NameStr(entry->node), (char *) lfirst(lc2),
+						NAMEDATALEN);
+			}
+		}
+		if (entry == NULL)
+			continue;
+
+		if (instr->ntuples < 1)
+			bucket = 0;
+		else
+			bucket = Min(pg_leftmost_one_pos64((uint64) instr->ntuples) + 1,
+						 PWS_ROWS_BUCKETS - 1);
+
+		entry->executions++;
+		entry->rows_hist[bucket]++;
+		entry->rows += instr->ntuples;
+		entry->max_rows = Max(entry->max_rows, instr->ntuples);
+		entry->loops += instr->nloops;
+		if (instr->need_timer)
+		{
+			double		child_time = 0;
+
+			planstate_tree_walker(planstate, SumChildTime, &child_time);
+			entry->timed_executions++;
+			entry->total_time += instr->total * 1000.0;
+			entry->self_time += Max(instr->total - child_time, 0) * 1000.0;
+			entry->max_time = Max(entry->max_time, instr->total * 1000.0);
+		}
+		if (instr->need_bufusage)
+		{
+			entry->shared_blks_hit += instr->bufusage.shared_blks_hit;
+			entry->shared_blks_read += instr->bufusage.shared_blks_read;
+			entry->temp_blks += instr->bufusage.temp_blks_read +
+				instr->bufusage.temp_blks_written;
+		}
+		if (list_member_int(flagged, key.plan_node_id) ||
+			DetectSeqScanOverLimit(planstate))
+			entry->flagged++;
+		if (captured)
+			entry->last_capture = now;
+	}
+
+	LWLockRelease(pws->lock);
+}
+
+/*
+ * Collect the instrumented nodes of a plan tree.
+ */
+static bool
+CollectPlanNodes(PlanState *planstate, void *context)
+{
+	List	  **nodes = (List **) context;
+
+	if (planstate->instrument)
+		*nodes = lappend(*nodes, planstate);
+
+	return planstate_tree_walker(planstate, CollectPlanNodes, context);
+}
+
+/*
+ * Add the folded stacks of a sampled query to the shared profile.
+ */
+static void
+RecordFoldedStacks(QueryDesc *queryDesc)
+{
+	FoldedStackContext fctx;
+
+	if (!pws || !pws_stack_hash || IsParallelWorker() ||
+		(queryDesc->estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0)
+		return;
+
+	initStringInfo(&fctx.stack);
+	appendStringInfo(&fctx.stack, INT64_FORMAT,
+					 queryDesc->plannedstmt->queryId);
+	fctx.samples = NIL;
+	CollectFoldedStacks(queryDesc->planstate, &fctx);
+
+	LWLockAcquire(pws->lock, LW_EXCLUSIVE);
+
+	foreach_ptr(FoldedStackSample, sample, fctx.samples)
+	{
+		pwsStackKey key;
+		pwsStackEntry *entry;
+		bool		found;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		if (strlen(sample->stack) < PWS_STACK_LEN)
+			strlcpy(key.stack, sample->stack, PWS_STACK_LEN);
+		else
+		{
+			int			len = pg_mbcliplen(sample->stack, strlen(sample->stack),
+										   PWS_STACK_LEN - 5);
+
+			memcpy(key.stack, sample->stack, len);
+			strlcpy(key.stack + len, ";...", PWS_STACK_LEN - len);
+		}
+
+		entry = (pwsStackEntry *) hash_search(pws_stack_hash, &key,
+											  HASH_FIND, NULL);
+		if (!entry &&
+			hash_get_num_entries(pws_stack_hash) < pg_plan_watch_max_stacks)
+		{
+			entry = (pwsStackEntry *) hash_search(pws_stack_hash, &key,
+												  HASH_ENTER, &found);
+			if (!found)
+			{
+				entry->samples = 0;
+				entry->self_time = 0;
+			}
+		}
+		if (entry == NULL)
+			continue;
+
+		entry->samples++;
+		entry->self_time += sample->self_time;
+	}
+
+	LWLockRelease(pws->lock);
+}
+
+/*
+ * Collect the folded stack and self time of each timed node of a plan tree.
+ * fctx->stack holds the frames of the parents of the node.
+ */
+static bool
+CollectFoldedStacks(PlanState *planstate, void *context)
+{
+	FoldedStackContext *fctx = (FoldedStackContext *) context;
+	Instrumentation *instr = planstate->instrument;
+	int			save_len = fctx->stack.len;
+	Index		scanrelid;
+	const char *name = PlanNodeName(planstate->plan, &scanrelid);
+
+	appendStringInfo(&fctx->stack, ";%s", name);
+	if (scanrelid > 0)
+	{
+		RangeTblEntry *rte = rt_fetch(scanrelid,
+									  planstate->state->es_range_table);
+		char	   *relname = NULL;
+
+		if (rte->rtekind == RTE_RELATION)
+			relname = get_rel_name(rte->relid);
+		if (relname != NULL)
+		{
+			/* ';' separates frames */
+			for (char *c = relname; *c; c++)
+			{
+				if (*c == ';')
+					*c = '_';
+			}
+			appendStringInfo(&fctx->stack, " on %s", relname);
+		}
+	}
+
+	if (instr && instr->need_timer && instr->nloops > 0)
+	{
+		FoldedStackSample *sample = palloc(sizeof(FoldedStackSample));
+		double		child_time = 0;
+
+		planstate_tree_walker(planstate, SumChildTime, &child_time);
+		sample->stack = pstrdup(fctx->stack.data);
+		sample->self_time = Max(instr->total - child_time, 0) * 1000.0;
+		fctx->samples = lappend(fctx->samples, sample);
+	}
+
+	planstate_tree_walker(planstate, CollectFoldedStacks, context);
+
+	fctx->stack.len = save_len;
+	fctx->stack.data[save_len] = '\0';
+
+	return false;
+}
+
+/*
+ * Estimate a percentile of the rows per execution of a plan node, by linear
+ * interpolation within the histogram bucket it falls in.
+ */
+static double
+pws_rows_percentile(const pwsNodeEntry *entry, double fraction)
+{
+	double		target = fraction * entry->executions;
+	double		seen = 0;
+
+	for (int b = 0; b < PWS_ROWS_BUCKETS; b++)
+	{
+		double		count = entry->rows_hist[b];
+		double		lo;
+		double		hi;
+
+		if (count <= 0 || seen + count < target)
+		{
+			seen += count;
+			continue;
+		}
+
+		if (b == 0)
+			return 0;
+
+		lo = ldexp(1.0, b - 1);
+		if (b == PWS_ROWS_BUCKETS - 1)
+			return lo;			/* unbounded */
+		hi = ldexp(1.0, b);
+
+		return lo + (hi - lo) * (target - seen) / count;
+	}
+
+	return 0;
+}
+
+/*
+ * Fit the cost calibration of one tablespace by ordinary least squares.
+ *
+ * Variables that were never observed are left out of the fit and marked
+ * inactive.  On success, beta holds the time in milliseconds per unit of
+ * each variable, and if there are enough samples to estimate the residual
+ * variance, cov holds the covariance matrix of the estimates.
+ */
+static bool
+pws_calib_fit(const pwsCalibEntry *entry,
+			  bool active[PWS_CALIB_NVARS],
+			  double beta[PWS_CALIB_NVARS],
+			  double cov[PWS_CALIB_NVARS][PWS_CALIB_NVARS],
+			  bool *have_cov)
+{
+	int			vars[PWS_CALIB_NVARS];
+	double		a[PWS_CALIB_NVARS][2 * PWS_CALIB_NVARS];
+	double		b[PWS_CALIB_NVARS];
+	double		sse;
+	int			k = 0;
+
+	memset(beta, 0, sizeof(double) * PWS_CALIB_NVARS);
+	memset(cov, 0, sizeof(double) * PWS_CALIB_NVARS * PWS_CALIB_NVARS);
+	*have_cov = false;
+
+	for (int i = 0; i < PWS_CALIB_NVARS; i++)
+	{
+		active[i] = (entry->xtx[i][i] > 0);
+		if (active[i])
+			vars[k++] = i;
+	}
+	if (k == 0)
+		return false;
+
+	/* Invert the normal matrix by Gauss-Jordan elimination */
+	for (int r = 0; r < k; r++)
+	{
+		for (int c = 0; c < k; c++)
+		{
+			a[r][c] = entry->xtx[vars[r]][vars[c]];
+			a[r][k + c] = (r == c) ? 1.0 : 0.0;
+		}
+	}
+
+	for (int col = 0; col < k; col++)
+	{
+		int			pivot = col;
+		double		scale;
+
+		for (int r = col + 1; r < k; r++)
+			if (fabs(a[r][col]) > fabs(a[pivot][col]))
+				pivot = r;
+		if (fabs(a[pivot][col]) <= 1e-12 * entry->xtx[vars[col]][vars[col]])
+			return false;		/* singular, e.g. collinear samples */
+
+		if (pivot != col)
+		{
+			for (int c = 0; c < 2 * k; c++)
+			{
+				double		tmp = a[col][c];
+
+				a[col][c] = a[pivot][c];
+				a[pivot][c] = tmp;
+			}
+		}
+
+		scale = a[col][col];
+		for (int c = 0; c < 2 * k; c++)
+			a[col][c] /= scale;
+
+		for (int r = 0; r < k; r++)
+		{
+			double		factor = a[r][col];
+
+			if (r == col || factor == 0)
+				continue;
+			for (int c = 0; c < 2 * k; c++)
+				a[r][c] -= factor * a[col][c];
+		}
+	}
+
+	/* beta = inv(X'X) X'y */
+	sse = entry->yty;
+	for (int r = 0; r < k; r++)
+	{
+		b[r] = 0;
+		for (int c = 0; c < k; c++)
+			b[r] += a[r][k + c] * entry->xty[vars[c]];
+		beta[vars[r]] = b[r];
+		sse -= b[r] * entry->xty[vars[r]];
+	}
+
+	/* cov = s^2 inv(X'X), with s^2 the residual variance */
+	if (entry->samples > k)
+	{
+		double		s2 = Max(sse, 0) / (entry->samples - k);
+
+		for (int r = 0; r < k; r++)
+			for (int c = 0; c < k; c++)
+				cov[vars[r]][vars[c]] = s2 * a[r][k + c];
+		*have_cov = true;
+	}
+
+	return true;
+}
+
+/*
+ * Estimate the ratio of two fitted coefficients, with a 95% confidence
+ * interval obtained by the delta method.
+ */
+static void
+pws_ratio_ci(const double beta[PWS_CALIB_NVARS],
+			 double cov[PWS_CALIB_NVARS][PWS_CALIB_NVARS],
+			 int num, int den,
+			 double *estimate, double *low, double *high)
+{
+	double		n = beta[num];
+	double		d = beta[den];
+	double		var;
+	double		sd;
+
+	*estimate = n / d;
+	var = cov[num][num] / (d * d) +
+		n * n * cov[den][den] / (d * d * d * d) -
+		2 * n * cov[num][den] / (d * d * d);
+	sd = sqrt(Max(var, 0));
+	*low = *estimate - 1.96 * sd;
+	*high = *estimate + 1.96 * sd;
+}
+
+/*
+ * Check that shared memory statistics are available.
+ */
+void
+pws_check_available(void)
+{
+	if (!pws || !pws_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_watch must be loaded via \"shared_preload_libraries\"")));
+}
+
+/*
+ * Retrieve the shared statistics, one row per entry.
+ */
+Datum
+pg_plan_watch_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	pwsEntry   *entry;
+
+	pws_check_available();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(pws->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pws_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[10];
+		bool		nulls[10] = {0};
+		Datum		counters[PWS_NUM_COUNTERS];
+		int64		calls;
+		TimestampTz last_seen;
+		int			i = 0;
+
+		/* copy counters to a local variable to keep locking time short */
+		SpinLockAcquire(&entry->mutex);
+		calls = entry->calls;
+		for (int j = 0; j < PWS_NUM_COUNTERS; j++)
+			counters[j] = Float8GetDatum(entry->counters[j]);
+		last_seen = entry->last_seen;
+		SpinLockRelease(&entry->mutex);
+
+		values[i++] = CStringGetTextDatum(pwsKindNames[entry->key.kind]);
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = Int64GetDatumFast(entry->key.queryid);
+		if (OidIsValid(entry->key.relid))
+			values[i++] = ObjectIdGetDatum(entry->key.relid);
+		else
+			nulls[i++] = true;
+		if (OidIsValid(entry->key.funcid))
+			values[i++] = ObjectIdGetDatum(entry->key.funcid);
+		else
+			nulls[i++] = true;
+		if (entry->key.plan_node_id >= 0)
+			values[i++] = Int32GetDatum(entry->key.plan_node_id);
+		else
+			nulls[i++] = true;
+		if (NameStr(entry->key.label)[0] != '\0')
+			values[i++] = CStringGetTextDatum(NameStr(entry->key.label));
+		else
+			nulls[i++] = true;
+		values[i++] = Int64GetDatumFast(calls);
+		values[i++] = PointerGetDatum(construct_array_builtin(counters,
+															  PWS_NUM_COUNTERS,
+															  FLOAT8OID));
+		values[i++] = TimestampTzGetDatum(last_seen);
+
+		Assert(i == lengthof(values));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(pws->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Retrieve the per-node execution statistics, one row per plan node.
+ */
+Datum
+pg_plan_watch_node_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	pwsNodeEntry *entry;
+
+	pws_check_available();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(pws->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pws_node_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[19];
+		bool		nulls[19] = {0};
+		int			i = 0;
+
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = Int64GetDatumFast(entry->key.queryid);
+		values[i++] = Int64GetDatumFast(entry->key.planid);
+		values[i++] = Int32GetDatum(entry->key.plan_node_id);
+		values[i++] = CStringGetTextDatum(NameStr(entry->node));
+		values[i++] = Int64GetDatumFast(entry->executions);
+		values[i++] = Int64GetDatumFast(entry->flagged);
+		values[i++] = Float8GetDatumFast(entry->rows);
+		values[i++] = Float8GetDatumFast(entry->max_rows);
+		values[i++] = Float8GetDatumFast(pws_rows_percentile(entry, 0.95));
+		values[i++] = Float8GetDatumFast(entry->loops);
+		values[i++] = Int64GetDatumFast(entry->timed_executions);
+		values[i++] = Float8GetDatumFast(entry->total_time);
+		values[i++] = Float8GetDatumFast(entry->self_time);
+		values[i++] = Float8GetDatumFast(entry->max_time);
+		values[i++] = Int64GetDatumFast(entry->shared_blks_hit);
+		values[i++] = Int64GetDatumFast(entry->shared_blks_read);
+		values[i++] = Int64GetDatumFast(entry->temp_blks);
+		if (entry->last_capture != 0)
+			values[i++] = TimestampTzGetDatum(entry->last_capture);
+		else
+			nulls[i++] = true;
+
+		Assert(i == lengthof(values));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(pws->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Retrieve the folded stacks of sampled queries.  The folded column is in
+ * the format flame-graph tools read: the stack, a space, and the self time
+ * in microseconds.
+ */
+Datum
+pg_plan_watch_folded_stacks(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	pwsStackEntry *entry;
+
+	pws_check_available();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(pws->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pws_stack_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[5];
+		bool		nulls[5] = {0};
+		int			i = 0;
+
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = CStringGetTextDatum(entry->key.stack);
+		values[i++] = Int64GetDatumFast(entry->samples);
+		values[i++] = Float8GetDatumFast(entry->self_time);
+		values[i++] = CStringGetTextDatum(psprintf("%s %.0f", entry->key.stack,
+												   entry->self_time * 1000.0));
+
+		Assert(i == lengthof(values));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(pws->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Reset the shared statistics.
+ */
+Datum
+pg_plan_watch_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pwsEntry   *entry;
+	pwsCalibEntry *calib;
+	pwsNodeEntry *node;
+	pwsStackEntry *stack;
+
+	pws_check_available();
+
+	LWLockAcquire(pws->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pws_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pws_hash, &entry->key, HASH_REMOVE, NULL);
+
+	hash_seq_init(&hash_seq, pws_calib_hash);
+	while ((calib = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pws_calib_hash, &calib->spcid, HASH_REMOVE, NULL);
+
+	hash_seq_init(&hash_seq, pws_node_hash);
+	while ((node = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pws_node_hash, &node->key, HASH_REMOVE, NULL);
+
+	hash_seq_init(&hash_seq, pws_stack_hash);
+	while ((stack = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pws_stack_hash, &stack->key, HASH_REMOVE, NULL);
+
+	pg_atomic_write_u64(&pws->metrics_sent, 0);
+	pg_atomic_write_u64(&pws->metrics_dropped, 0);
+
+	LWLockRelease(pws->lock);
+
+	if (pws_queue)
+	{
+		LWLockAcquire(pws->queue_lock, LW_EXCLUSIVE);
+		pws_queue->dropped = 0;
+		LWLockRelease(pws->queue_lock);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Report the planner cost calibration of each tablespace.
+ *
+ * Recommended costs are expressed relative to the tablespace's current
+ * seq_page_cost, which the fit cannot determine by itself.
+ */
+Datum
+pg_plan_watch_cost_calibration(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	pwsCalibEntry *entry;
+	pwsCalibEntry *entries;
+	int			nentries = 0;
+
+	pws_check_available();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	/* Copy the entries, so that we don't look up catalogs under the lock */
+	entries = palloc(sizeof(pwsCalibEntry) * PWS_CALIB_MAX_TABLESPACES);
+
+	LWLockAcquire(pws->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pws_calib_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (nentries < PWS_CALIB_MAX_TABLESPACES)
+			entries[nentries++] = *entry;
+	}
+	LWLockRelease(pws->lock);
+
+	for (int n = 0; n < nentries; n++)
+	{
+		Datum		values[12];
+		bool		nulls[12] = {0};
+		bool		active[PWS_CALIB_NVARS];
+		double		beta[PWS_CALIB_NVARS];
+		double		cov[PWS_CALIB_NVARS][PWS_CALIB_NVARS];
+		bool		have_cov;
+		double		spc_random_page_cost;
+		double		spc_seq_page_cost;
+		bool		fitted;
+		int			i = 0;
+
+		entry = &entries[n];
+		fitted = pws_calib_fit(entry, active, beta, cov, &have_cov);
+		get_tablespace_page_costs(entry->spcid,
+								  &spc_random_page_cost,
+								  &spc_seq_page_cost);
+
+		values[i++] = ObjectIdGetDatum(entry->spcid);
+		values[i++] = Int64GetDatumFast(entry->samples);
+
+		/* time per unit of each variable */
+		for (int v = 0; v < PWS_CALIB_NVARS; v++)
+		{
+			if (fitted && active[v])
+				values[i++] = Float8GetDatum(beta[v]);
+			else
+				nulls[i++] = true;
+		}
+
+		values[i++] = Float8GetDatum(spc_seq_page_cost);
+
+		/* recommended costs, relative to the sequential page time */
+		for (int v = PWS_CALIB_RANDOM_PAGES; v < PWS_CALIB_NVARS; v++)
+		{
+			double		estimate;
+			double		low;
+			double		high;
+
+			if (!fitted || !active[v] || !active[PWS_CALIB_SEQ_PAGES] ||
+				beta[PWS_CALIB_SEQ_PAGES] <= 0)
+			{
+				nulls[i++] = true;
+				nulls[i++] = true;
+				nulls[i++] = true;
+				continue;
+			}
+
+			pws_ratio_ci(beta, cov, v, PWS_CALIB_SEQ_PAGES,
+						 &estimate, &low, &high);
+			values[i++] = Float8GetDatum(estimate * spc_seq_page_cost);
+			if (have_cov)
+			{
+				values[i++] = Float8GetDatum(low * spc_seq_page_cost);
+				values[i++] = Float8GetDatum(high * spc_seq_page_cost);
+			}
+			else
+			{
+				nulls[i++] = true;
+				nulls[i++] = true;
+			}
+		}
+
+		Assert(i == lengthof(values));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
 
-	/* Recursively check child nodes */
-	return planstate_tree_walker(planstate, DetectSeqScanOverLimit, context);
+	return (Datum) 0;
 }
@@ -0,0 +1,150 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch.h
+ *		  Declarations shared by the source files of pg_plan_watch
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_PLAN_WATCH_H
+#define PG_PLAN_WATCH_H
+
+#include "executor/execdesc.h"
+#include "nodes/execnodes.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+typedef struct pwsSharedState
+{
+	LWLock	   *lock;			/* protects hashtable search/modification */
+	LWLock	   *queue_lock;		/* protects pws_queue */
+	pg_atomic_uint64 metrics_sent;	/* datagrams sent to metrics_target */
+	pg_atomic_uint64 metrics_dropped;	/* datagrams that could not be sent */
+} pwsSharedState;
+
+/*
+ * Per-node execution statistics, also used by EXPLAIN (PLAN_WATCH).
+ *
+ * Every node of a sampled or captured query gets an entry, keyed by query,
+ * plan shape (see FingerprintPlanState) and plan node.  The rows a node
+ * produces per execution are also counted in a histogram of power-of-two
+ * buckets: bucket 0 holds executions that produced no rows, and bucket
+ * b > 0 those that produced between 2^(b-1) and 2^b - 1, the last bucket
+ * taking everything above.
+ */
+#define PWS_ROWS_BUCKETS	32
+
+typedef struct pwsNodeKey
+{
+	Oid			dbid;			/* database OID */
+	int64		queryid;		/* query identifier */
+	int64		planid;			/* plan fingerprint */
+	int32		plan_node_id;	/* plan node */
+} pwsNodeKey;
+
+typedef struct pwsNodeEntry
+{
+	pwsNodeKey	key;			/* hash key of entry - MUST BE FIRST */
+	NameData	node;			/* description of the node */
+	int64		executions;		/* number of executions recorded */
+	int64		flagged;		/* executions in which a detector fired */
+	double		rows;			/* total rows produced */
+	double		max_rows;		/* most rows produced by one execution */
+	double		loops;			/* total loops */
+	int64		timed_executions;	/* executions with timing */
+	double		total_time;		/* total time, in msec */
+	double		self_time;		/* total time less children's, in msec */
+	double		max_time;		/* longest execution, in msec */
+	int64		shared_blks_hit;	/* executions with buffers count these */
+	int64		shared_blks_read;
+	int64		temp_blks;		/* temp blocks read and written */
+	int64		rows_hist[PWS_ROWS_BUCKETS];	/* rows per execution */
+	TimestampTz last_capture;	/* time the query was last captured, or 0 */
+} pwsNodeEntry;
+
+/*
+ * Captures waiting to be persisted by the background worker, in a ring of
+ * pg_plan_watch.persist_queue_size records.  Backends only copy into the
+ * ring; the worker does the inserts.  Plans longer than
+ * PWS_CAPTURE_PLAN_LEN are cut.
+ */
+#define PWS_CAPTURE_PLAN_LEN	16384
+
+/*
+ * Captures persisted per transaction: half the queue, so that backends can
+ * go on queueing meanwhile, and at most 16MB of them.
+ */
+#define PWS_PERSIST_MAX_BATCH	1024
+#define pws_persist_batch_size() \
+	Min(pg_plan_watch_persist_queue_size / 2, PWS_PERSIST_MAX_BATCH)
+
+typedef struct pwsCaptureRecord
+{
+	TimestampTz captured_at;	/* end of the query */
+	Oid			dbid;			/* database OID */
+	Oid			userid;			/* user OID */
+	int64		queryid;		/* query identifier */
+	double		duration;		/* in msec */
+	char		plan[PWS_CAPTURE_PLAN_LEN]; /* rendered plan */
+} pwsCaptureRecord;
+
+typedef struct pwsCaptureQueue
+{
+	PGPROC	   *worker;			/* the persisting worker, or NULL */
+	uint64		head;			/* next record to write */
+	uint64		tail;			/* next record to persist */
+	uint64		dropped;		/* captures lost because the ring was full */
+	pwsCaptureRecord records[FLEXIBLE_ARRAY_MEMBER];
+} pwsCaptureQueue;
+
+/* Header of the capture file, see pg_plan_watch_ring.c */
+typedef struct pwsRingHeader pwsRingHeader;
+
+/* GUC variables */
+extern int	pg_plan_watch_max_nodes;
+extern char *pg_plan_watch_otlp_target;
+extern char *pg_plan_watch_trace_context;
+extern char *pg_plan_watch_metrics_target;
+extern char *pg_plan_watch_persist_database;
+extern int	pg_plan_watch_persist_queue_size;
+extern int	pg_plan_watch_persist_naptime;
+extern int	pg_plan_watch_persist_retention;
+extern char *pg_plan_watch_capture_file;
+extern int	pg_plan_watch_capture_file_slots;
+
+/* Links to shared memory state, NULL unless loaded at server start */
+extern pwsSharedState *pws;
+extern HTAB *pws_node_hash;
+extern pwsCaptureQueue *pws_queue;
+
+/* Mapping of the capture file, NULL if there is none */
+extern pwsRingHeader *pws_ring;
+
+/* Is this the background worker persisting captures? */
+extern bool am_persist_worker;
+
+/* in pg_plan_watch.c */
+extern char *DescribePlanNode(PlanState *planstate);
+extern void pws_check_available(void);
+
+/* in pg_plan_watch_otlp.c */
+extern void ExportPlanSpans(QueryDesc *queryDesc);
+
+/* in pg_plan_watch_metrics.c */
+extern void SendSeqScanMetric(ScanState *node, int64 queryid);
+
+/* in pg_plan_watch_persist.c */
+extern void QueueCapture(QueryDesc *queryDesc, const char *plan);
+extern char *GetCapturesTable(void);
+extern PGDLLEXPORT void pg_plan_watch_persist_main(Datum main_arg);
+
+/* in pg_plan_watch_ring.c */
+extern void MapCaptureFile(void);
+extern void WriteCaptureFile(QueryDesc *queryDesc, const char *plan);
+
+#endif							/* PG_PLAN_WATCH_H */
@@ -0,0 +1,571 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch_columnar.c
+ *		  Export of captures and node statistics to a columnar file
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch_columnar.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "pg_plan_watch.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/*
+ * Columnar export, see pg_plan_watch_export_columnar.
+ *
+ * All integers are big-endian, and floats IEEE 754 doubles, as in binary
+ * COPY.  The file is the magic "PWSCOL", a NUL and the layout version 1 (8
+ * bytes), an int32 number of tables, then the tables.  A table is:
+ *
+ *	int16 length and bytes of its name
+ *	int16 number of columns
+ *	for each column, int16 length and bytes of its name, and a type byte
+ *	chunks of rows, ended by a chunk of 0 rows
+ *
+ * A chunk is an int32 number of rows, up to PWS_COLUMNAR_CHUNK_ROWS, then
+ * for each column an int32 length and the column's data in the chunk: a
+ * validity bitmap of (rows + 7) / 8 bytes, in which bit i % 8 of byte i / 8
+ * is set when row i is not null, then the values by type:
+ *
+ *	'l'	int64 for each row
+ *	'd'	float8 for each row
+ *	't'	int64 for each row, in microseconds since the Unix epoch
+ *	's'	int32 length and bytes for each row
+ *	'k'	int32 number of distinct values, int32 length and bytes of each,
+ *		then int32 index of the value for each row
+ *
+ * Null rows hold zeros.  The dictionary of 'k' columns is per chunk.
+ */
+#define PWS_COLUMNAR_MAGIC		"PWSCOL\0\1"
+#define PWS_COLUMNAR_CHUNK_ROWS	4096
+
+#define PWS_COL_INT8		'l'
+#define PWS_COL_FLOAT8		'd'
+#define PWS_COL_TIMESTAMP	't'
+#define PWS_COL_TEXT		's'
+#define PWS_COL_DICT		'k'
+
+typedef struct pwsColumn
+{
+	const char *name;
+	char		type;			/* PWS_COL_* */
+} pwsColumn;
+
+/* Data of one column in the chunk being built */
+typedef struct pwsColumnChunk
+{
+	char		type;			/* PWS_COL_* */
+	int			nrows;
+	bits8		validity[PWS_COLUMNAR_CHUNK_ROWS / 8];
+	StringInfoData values;		/* values, or indexes for dictionaries */
+	HTAB	   *dict;			/* value to index, for dictionaries */
+	StringInfoData dict_values; /* dictionary, for dictionaries */
+	int32		ndict;
+} pwsColumnChunk;
+
+typedef struct pwsDictEntry
+{
+	char		value[NAMEDATALEN]; /* hash key of entry - MUST BE FIRST */
+	int32		index;
+} pwsDictEntry;
+
+static const pwsColumn pws_capture_columns[] = {
+	{"captured_at", PWS_COL_TIMESTAMP},
+	{"dbid", PWS_COL_INT8},
+	{"userid", PWS_COL_INT8},
+	{"queryid", PWS_COL_INT8},
+	{"duration", PWS_COL_FLOAT8},
+	{"plan", PWS_COL_TEXT},
+};
+
+static const pwsColumn pws_node_columns[] = {
+	{"dbid", PWS_COL_INT8},
+	{"queryid", PWS_COL_INT8},
+	{"planid", PWS_COL_INT8},
+	{"plan_node_id", PWS_COL_INT8},
+	{"node_type", PWS_COL_DICT},
+	{"relation", PWS_COL_DICT},
+	{"executions", PWS_COL_INT8},
+	{"flagged", PWS_COL_INT8},
+	{"rows", PWS_COL_FLOAT8},
+	{"max_rows", PWS_COL_FLOAT8},
+	{"loops", PWS_COL_FLOAT8},
+	{"timed_executions", PWS_COL_INT8},
+	{"total_time", PWS_COL_FLOAT8},
+	{"self_time", PWS_COL_FLOAT8},
+	{"max_time", PWS_COL_FLOAT8},
+	{"shared_blks_hit", PWS_COL_INT8},
+	{"shared_blks_read", PWS_COL_INT8},
+	{"temp_blks", PWS_COL_INT8},
+	{"last_capture", PWS_COL_TIMESTAMP},
+};
+
+static int64 ExportColumnarCaptures(FILE *file, const char *path,
+									TimestampTz from, TimestampTz to);
+static int64 ExportColumnarNodes(FILE *file, const char *path);
+static void WriteColumnarTable(FILE *file, const char *path, const char *name,
+							   const pwsColumn *columns, int ncolumns);
+static void ColumnChunksInit(pwsColumnChunk *chunks, const pwsColumn *columns,
+							 int ncolumns);
+static void ColumnChunkAddInt64(pwsColumnChunk *chunk, int64 value, bool isnull);
+static void ColumnChunkAddFloat8(pwsColumnChunk *chunk, double value, bool isnull);
+static void ColumnChunkAddText(pwsColumnChunk *chunk, const char *value);
+static void WriteColumnChunks(FILE *file, const char *path,
+							  pwsColumnChunk *chunks, int ncolumns);
+static void WriteColumnarBuffer(FILE *file, const char *path, StringInfo buf);
+
+PG_FUNCTION_INFO_V1(pg_plan_watch_export_columnar);
+
+/*
+ * Export the persisted captures of a time range, and the per-node
+ * statistics currently kept, into a columnar file on the server (see
+ * PWS_COLUMNAR_MAGIC for the layout).  Returns the rows written.
+ */
+Datum
+pg_plan_watch_export_columnar(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	TimestampTz from = PG_GETARG_TIMESTAMPTZ(1);
+	TimestampTz to = PG_GETARG_TIMESTAMPTZ(2);
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = {0};
+	FILE	   *file;
+	StringInfoData buf;
+
+	pws_check_available();
+
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to export to a file"),
+				 errdetail("Only roles with privileges of the \"%s\" role may export to a file.",
+						   "pg_write_server_files")));
+
+	if (!is_absolute_path(path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("relative path not allowed for export to a file")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	file = AllocateFile(path, PG_BINARY_W);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", path)));
+
+	initStringInfo(&buf);
+	pq_sendbytes(&buf, PWS_COLUMNAR_MAGIC, 8);
+	pq_sendint32(&buf, 2);
+	WriteColumnarBuffer(file, path, &buf);
+
+	values[0] = Int64GetDatum(ExportColumnarCaptures(file, path, from, to));
+	values[1] = Int64GetDatum(ExportColumnarNodes(file, path));
+
+	if (FreeFile(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", path)));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Write the "captures" table of a columnar export, from the captures table
+ * of this database.
+ */
+static int64
+ExportColumnarCaptures(FILE *file, const char *path,
+					   TimestampTz from, TimestampTz to)
+{
+	int			ncolumns = lengthof(pws_capture_columns);
+	pwsColumnChunk chunks[lengthof(pws_capture_columns)];
+	MemoryContext chunk_cxt;
+	MemoryContext oldcxt;
+	char	   *table;
+	SPIPlanPtr	plan;
+	Portal		portal;
+	Oid			argtypes[2] = {TIMESTAMPTZOID, TIMESTAMPTZOID};
+	Datum		args[2];
+	int64		nrows = 0;
+
+	WriteColumnarTable(file, path, "captures", pws_capture_columns, ncolumns);
+
+	SPI_connect();
+
+	table = GetCapturesTable();
+	if (table == NULL)
+		elog(ERROR, "could not find the captures table");
+
+	plan = SPI_prepare(psprintf("SELECT captured_at, dbid, userid, queryid, duration, plan "
+								"FROM %s WHERE captured_at >= $1 AND captured_at < $2 "
+								"ORDER BY captured_at",
+								table),
+					   2, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "could not prepare export of %s", table);
+
+	args[0] = TimestampTzGetDatum(from);
+	args[1] = TimestampTzGetDatum(to);
+	portal = SPI_cursor_open(NULL, plan, args, NULL, true);
+
+	chunk_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "pg_plan_watch export chunk",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		SPITupleTable *tuptable;
+
+		SPI_cursor_fetch(portal, true, PWS_COLUMNAR_CHUNK_ROWS);
+		if (SPI_processed == 0)
+			break;
+		tuptable = SPI_tuptable;
+
+		oldcxt = MemoryContextSwitchTo(chunk_cxt);
+		ColumnChunksInit(chunks, pws_capture_columns, ncolumns);
+
+		for (uint64 i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tuple = tuptable->vals[i];
+			TupleDesc	desc = tuptable->tupdesc;
+			bool		isnull;
+			Datum		value;
+
+			value = SPI_getbinval(tuple, desc, 1, &isnull);
+			ColumnChunkAddInt64(&chunks[0],
+								DatumGetTimestampTz(value) +
+								(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY,
+								false);
+			value = SPI_getbinval(tuple, desc, 2, &isnull);
+			ColumnChunkAddInt64(&chunks[1], DatumGetObjectId(value), isnull);
+			value = SPI_getbinval(tuple, desc, 3, &isnull);
+			ColumnChunkAddInt64(&chunks[2], DatumGetObjectId(value), isnull);
+			value = SPI_getbinval(tuple, desc, 4, &isnull);
+			ColumnChunkAddInt64(&chunks[3], isnull ? 0 : DatumGetInt64(value), isnull);
+			value = SPI_getbinval(tuple, desc, 5, &isnull);
+			ColumnChunkAddFloat8(&chunks[4], isnull ? 0 : DatumGetFloat8(value), isnull);
+			value = SPI_getbinval(tuple, desc, 6, &isnull);
+			ColumnChunkAddText(&chunks[5], isnull ? NULL : TextDatumGetCString(value));
+		}
+		nrows += SPI_processed;
+
+		WriteColumnChunks(file, path, chunks, ncolumns);
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(chunk_cxt);
+		SPI_freetuptable(tuptable);
+	}
+
+	/* End the table */
+	oldcxt = MemoryContextSwitchTo(chunk_cxt);
+	ColumnChunksInit(chunks, pws_capture_columns, ncolumns);
+	WriteColumnChunks(file, path, chunks, ncolumns);
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(chunk_cxt);
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	return nrows;
+}
+
+/*
+ * Write the "nodes" table of a columnar export, from the per-node
+ * statistics of all databases.  Node descriptions are split into the node
+ * type and the relation scanned, if any.
+ */
+static int64
+ExportColumnarNodes(FILE *file, const char *path)
+{
+	int			ncolumns = lengthof(pws_node_columns);
+	pwsColumnChunk chunks[lengthof(pws_node_columns)];
+	MemoryContext chunk_cxt;
+	MemoryContext oldcxt;
+	HASH_SEQ_STATUS hash_seq;
+	pwsNodeEntry *entry;
+	pwsNodeEntry *entries;
+	int64		nentries = 0;
+
+	WriteColumnarTable(file, path, "nodes", pws_node_columns, ncolumns);
+
+	/* Copy the entries, so as not to hold the lock while writing */
+	entries = palloc_array(pwsNodeEntry, pg_plan_watch_max_nodes);
+
+	LWLockAcquire(pws->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pws_node_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (nentries >= pg_plan_watch_max_nodes)
+		{
+			hash_seq_term(&hash_seq);
+			break;
+		}
+		entries[nentries++] = *entry;
+	}
+	LWLockRelease(pws->lock);
+
+	chunk_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "pg_plan_watch export chunk",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(chunk_cxt);
+
+	for (int64 i = 0; i < nentries; i++)
+	{
+		const char *node;
+		const char *on;
+
+		if (i % PWS_COLUMNAR_CHUNK_ROWS == 0)
+		{
+			if (i > 0)
+			{
+				WriteColumnChunks(file, path, chunks, ncolumns);
+				MemoryContextReset(chunk_cxt);
+			}
+			ColumnChunksInit(chunks, pws_node_columns, ncolumns);
+		}
+
+		entry = &entries[i];
+		node = NameStr(entry->node);
+		on = strstr(node, " on ");
+
+		ColumnChunkAddInt64(&chunks[0], entry->key.dbid, false);
+		ColumnChunkAddInt64(&chunks[1], entry->key.queryid, false);
+		ColumnChunkAddInt64(&chunks[2], entry->key.planid, false);
+		ColumnChunkAddInt64(&chunks[3], entry->key.plan_node_id, false);
+		if (on)
+		{
+			ColumnChunkAddText(&chunks[4], pnstrdup(node, on - node));
+			ColumnChunkAddText(&chunks[5], on + strlen(" on "));
+		}
+		else
+		{
+			const char *paren = strstr(node, " (node ");
+
+			ColumnChunkAddText(&chunks[4],
+							   paren ? pnstrdup(node, paren - node) : node);
+			ColumnChunkAddText(&chunks[5], NULL);
+		}
+		ColumnChunkAddInt64(&chunks[6], entry->executions, false);
+		ColumnChunkAddInt64(&chunks[7], entry->flagged, false);
+		ColumnChunkAddFloat8(&chunks[8], entry->rows, false);
+		ColumnChunkAddFloat8(&chunks[9], entry->max_rows, false);
+		ColumnChunkAddFloat8(&chunks[10], entry->loops, false);
+		ColumnChunkAddInt64(&chunks[11], entry->timed_executions, false);
+		ColumnChunkAddFloat8(&chunks[12], entry->total_time, false);
+		ColumnChunkAddFloat8(&chunks[13], entry->self_time, false);
+		ColumnChunkAddFloat8(&chunks[14], entry->max_time, false);
+		ColumnChunkAddInt64(&chunks[15], entry->shared_blks_hit, false);
+		ColumnChunkAddInt64(&chunks[16], entry->shared_blks_read, false);
+		ColumnChunkAddInt64(&chunks[17], entry->temp_blks, false);
+		ColumnChunkAddInt64(&chunks[18],
+							entry->last_capture +
+							(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY,
+							entry->last_capture == 0);
+	}
+
+	if (nentries > 0)
+	{
+		WriteColumnChunks(file, path, chunks, ncolumns);
+		MemoryContextReset(chunk_cxt);
+	}
+
+	/* End the table */
+	ColumnChunksInit(chunks, pws_node_columns, ncolumns);
+	WriteColumnChunks(file, path, chunks, ncolumns);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(chunk_cxt);
+	pfree(entries);
+
+	return nentries;
+}
+
+/*
+ * Write the name and columns of a table of a columnar export.
+ */
+static void
+WriteColumnarTable(FILE *file, const char *path, const char *name,
+				   const pwsColumn *columns, int ncolumns)
+{
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	pq_sendint16(&buf, strlen(name));
+	pq_sendbytes(&buf, name, strlen(name));
+	pq_sendint16(&buf, ncolumns);
+	for (int i = 0; i < ncolumns; i++)
+	{
+		pq_sendint16(&buf, strlen(columns[i].name));
+		pq_sendbytes(&buf, columns[i].name, strlen(columns[i].name));
+		pq_sendbyte(&buf, columns[i].type);
+	}
+	WriteColumnarBuffer(file, path, &buf);
+	pfree(buf.data);
+}
+
+/*
+ * Start empty chunks of the given columns, in the current memory context.
+ */
+static void
+ColumnChunksInit(pwsColumnChunk *chunks, const pwsColumn *columns, int ncolumns)
+{
+	for (int i = 0; i < ncolumns; i++)
+	{
+		pwsColumnChunk *chunk = &chunks[i];
+
+		chunk->type = columns[i].type;
+		chunk->nrows = 0;
+		memset(chunk->validity, 0, sizeof(chunk->validity));
+		initStringInfo(&chunk->values);
+		chunk->dict = NULL;
+		chunk->ndict = 0;
+		if (chunk->type == PWS_COL_DICT)
+		{
+			HASHCTL		info;
+
+			info.keysize = NAMEDATALEN;
+			info.entrysize = sizeof(pwsDictEntry);
+			info.hcxt = CurrentMemoryContext;
+			chunk->dict = hash_create("pg_plan_watch export dictionary", 64,
+									  &info,
+									  HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+			initStringInfo(&chunk->dict_values);
+		}
+	}
+}
+
+static void
+ColumnChunkAddInt64(pwsColumnChunk *chunk, int64 value, bool isnull)
+{
+	Assert(chunk->nrows < PWS_COLUMNAR_CHUNK_ROWS);
+
+	if (!isnull)
+		chunk->validity[chunk->nrows / 8] |= 1 << (chunk->nrows % 8);
+	pq_sendint64(&chunk->values, isnull ? 0 : value);
+	chunk->nrows++;
+}
+
+static void
+ColumnChunkAddFloat8(pwsColumnChunk *chunk, double value, bool isnull)
+{
+	Assert(chunk->nrows < PWS_COLUMNAR_CHUNK_ROWS);
+
+	if (!isnull)
+		chunk->validity[chunk->nrows / 8] |= 1 << (chunk->nrows % 8);
+	pq_sendfloat8(&chunk->values, isnull ? 0 : value);
+	chunk->nrows++;
+}
+
+/*
+ * Add a text value, or a null if value is NULL.  Dictionary values are cut
+ * to NAMEDATALEN - 1 bytes, which node descriptions fit in.
+ */
+static void
+ColumnChunkAddText(pwsColumnChunk *chunk, const char *value)
+{
+	Assert(chunk->nrows < PWS_COLUMNAR_CHUNK_ROWS);
+
+	if (value == NULL)
+		pq_sendint32(&chunk->values, 0);
+	else if (chunk->type == PWS_COL_DICT)
+	{
+		pwsDictEntry *entry;
+		bool		found;
+
+		entry = hash_search(chunk->dict, value, HASH_ENTER, &found);
+		if (!found)
+		{
+			int			len = strlen(entry->value);
+
+			entry->index = chunk->ndict++;
+			pq_sendint32(&chunk->dict_values, len);
+			pq_sendbytes(&chunk->dict_values, entry->value, len);
+		}
+		pq_sendint32(&chunk->values, entry->index);
+	}
+	else
+	{
+		int			len = strlen(value);
+
+		pq_sendint32(&chunk->values, len);
+		pq_sendbytes(&chunk->values, value, len);
+	}
+
+	if (value != NULL)
+		chunk->validity[chunk->nrows / 8] |= 1 << (chunk->nrows % 8);
+	chunk->nrows++;
+}
+
+/*
+ * Write a chunk of rows of a columnar export.  A chunk of no rows ends the
+ * table.
+ */
+static void
+WriteColumnChunks(FILE *file, const char *path, pwsColumnChunk *chunks,
+				  int ncolumns)
+{
+	StringInfoData buf;
+	int			nrows = chunks[0].nrows;
+	int			validity_len = (nrows + 7) / 8;
+
+	initStringInfo(&buf);
+	pq_sendint32(&buf, nrows);
+	if (nrows == 0)
+	{
+		WriteColumnarBuffer(file, path, &buf);
+		pfree(buf.data);
+		return;
+	}
+
+	for (int i = 0; i < ncolumns; i++)
+	{
+		pwsColumnChunk *chunk = &chunks[i];
+		int			len = validity_len + chunk->values.len;
+
+		Assert(chunk->nrows == nrows);
+
+		if (chunk->type == PWS_COL_DICT)
+			len += sizeof(int32) + chunk->dict_values.len;
+
+		pq_sendint32(&buf, len);
+		pq_sendbytes(&buf, chunk->validity, validity_len);
+		if (chunk->type == PWS_COL_DICT)
+		{
+			pq_sendint32(&buf, chunk->ndict);
+			pq_sendbytes(&buf, chunk->dict_values.data, chunk->dict_values.len);
+		}
+		pq_sendbytes(&buf, chunk->values.data, chunk->values.len);
+		WriteColumnarBuffer(file, path, &buf);
+	}
+	pfree(buf.data);
+}
+
+/*
+ * Append the contents of buf to a columnar export, and empty buf.
+ */
+static void
+WriteColumnarBuffer(FILE *file, const char *path, StringInfo buf)
+{
+	if (fwrite(buf->data, 1, buf->len, file) != buf->len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	resetStringInfo(buf);
+}
@@ -0,0 +1,249 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch_metrics.c
+ *		  Statsd metrics of flagged sequential scans
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch_metrics.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "executor/instrument.h"
+#include "funcapi.h"
+#include "pg_plan_watch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+/*
+ * Socket to pg_plan_watch.metrics_target, opened on first use and reopened
+ * if the setting changes.  A target that can't be opened is retried every
+ * PW_METRICS_RETRY_INTERVAL ms, and the failure is logged once.
+ */
+static pgsocket metrics_sock = PGINVALID_SOCKET;
+static char *metrics_sock_target = NULL;	/* target metrics_sock is for */
+static bool metrics_send_failed = false;	/* send error already logged */
+static char *metrics_failed_target = NULL;	/* target that failed to open */
+static TimestampTz metrics_failed_at = 0;	/* ... and when */
+static struct sockaddr_storage metrics_addr;
+static socklen_t metrics_addrlen;
+
+#define PW_METRICS_RETRY_INTERVAL	10000
+
+static bool OpenMetricsSocket(void);
+
+PG_FUNCTION_INFO_V1(pg_plan_watch_metrics_sink);
+
+/*
+ * Send a flagged sequential scan to pg_plan_watch.metrics_target, as
+ * statsd metrics with DogStatsD-style tags:
+ *
+ *	pg_plan_watch.seqscan.tuples:<tuples>|c|#relation:<name>,queryid:<id>
+ *	pg_plan_watch.seqscan.duration:<msec>|ms|#relation:<name>,queryid:<id>
+ *
+ * both in one datagram.  The socket is non-blocking: when its buffer is
+ * full, the datagram is dropped and counted rather than waited for.  Other
+ * errors, such as a missing receiver, are logged once until a datagram
+ * gets through again.
+ */
+void
+SendSeqScanMetric(ScanState *node, int64 queryid)
+{
+	Instrumentation *instr = node->ps.instrument;
+	char	   *relname;
+	StringInfoData tags;
+	StringInfoData buf;
+
+	if (node->ss_currentRelation == NULL || IsParallelWorker() ||
+		!OpenMetricsSocket())
+		return;
+
+	/* Keep statsd's separators out of the relation name */
+	relname = pstrdup(RelationGetRelationName(node->ss_currentRelation));
+	for (char *c = relname; *c; c++)
+	{
+		if (strchr(":|,#\n", *c))
+			*c = '_';
+	}
+
+	initStringInfo(&tags);
+	appendStringInfo(&tags, "#relation:%s,queryid:" INT64_FORMAT,
+					 relname, queryid);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "pg_plan_watch.seqscan.tuples:%.0f|c|%s",
+					 instr->ntuples, tags.data);
+	if (instr->need_timer)
+		appendStringInfo(&buf, "\npg_plan_watch.seqscan.duration:%.3f|ms|%s",
+						 instr->total * 1000.0, tags.data);
+
+	if (sendto(metrics_sock, buf.data, buf.len, 0,
+			   (struct sockaddr *) &metrics_addr, metrics_addrlen) >= 0)
+	{
+		if (pws)
+			pg_atomic_fetch_add_u64(&pws->metrics_sent, 1);
+		metrics_send_failed = false;
+	}
+	else if (errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+		if (pws)
+			pg_atomic_fetch_add_u64(&pws->metrics_dropped, 1);
+	}
+	else if (!metrics_send_failed)
+	{
+		ereport(LOG,
+				(errcode_for_socket_access(),
+				 errmsg("could not send metrics to \"%s\": %m",
+						pg_plan_watch_metrics_target)));
+		metrics_send_failed = true;
+	}
+
+	pfree(tags.data);
+	pfree(buf.data);
+}
+
+/*
+ * Make sure metrics_sock is open for the current metrics_target.  Returns
+ * false if it can't be; that is logged once per setting, and opening is
+ * retried after PW_METRICS_RETRY_INTERVAL.
+ */
+static bool
+OpenMetricsSocket(void)
+{
+	const char *target = pg_plan_watch_metrics_target;
+	bool		retrying;
+	int			elevel;
+	TimestampTz now;
+
+	if (metrics_sock_target != NULL && strcmp(metrics_sock_target, target) == 0)
+		return true;
+
+	now = GetCurrentTimestamp();
+	retrying = (metrics_failed_target != NULL &&
+				strcmp(metrics_failed_target, target) == 0);
+	if (retrying &&
+		!TimestampDifferenceExceeds(metrics_failed_at, now,
+									PW_METRICS_RETRY_INTERVAL))
+		return false;
+	elevel = retrying ? DEBUG1 : LOG;
+
+	if (metrics_sock != PGINVALID_SOCKET)
+		closesocket(metrics_sock);
+	metrics_sock = PGINVALID_SOCKET;
+	if (metrics_sock_target)
+		pfree(metrics_sock_target);
+	metrics_sock_target = NULL;
+
+	memset(&metrics_addr, 0, sizeof(metrics_addr));
+	if (strncmp(target, "unix:", 5) == 0)
+	{
+		struct sockaddr_un *addr = (struct sockaddr_un *) &metrics_addr;
+
+		addr->sun_family = AF_UNIX;
+		strlcpy(addr->sun_path, target + 5, sizeof(addr->sun_path));
+		metrics_addrlen = sizeof(struct sockaddr_un);
+	}
+	else
+	{
+		char	   *host = pstrdup(target);
+		char	   *port = strrchr(host, ':');
+		struct addrinfo hints;
+		struct addrinfo *res;
+		int			rc;
+
+		if (port == NULL)
+		{
+			ereport(elevel,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid pg_plan_watch.metrics_target \"%s\"", target),
+					 errhint("Use \"unix:path\" or \"host:port\".")));
+			pfree(host);
+			goto fail;
+		}
+		*port++ = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_NUMERICSERV;
+		rc = getaddrinfo(host, port, &hints, &res);
+		pfree(host);
+		if (rc != 0)
+		{
+			ereport(elevel,
+					(errmsg("could not resolve pg_plan_watch.metrics_target \"%s\": %s",
+							target, gai_strerror(rc))));
+			goto fail;
+		}
+		memcpy(&metrics_addr, res->ai_addr, res->ai_addrlen);
+		metrics_addrlen = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+
+	metrics_sock = socket(metrics_addr.ss_family, SOCK_DGRAM, 0);
+	if (metrics_sock == PGINVALID_SOCKET)
+	{
+		ereport(elevel,
+				(errcode_for_socket_access(),
+				 errmsg("could not create socket for metrics: %m")));
+		goto fail;
+	}
+
+	if (!pg_set_noblock(metrics_sock))
+	{
+		ereport(elevel,
+				(errcode_for_socket_access(),
+				 errmsg("could not set metrics socket to nonblocking mode: %m")));
+		closesocket(metrics_sock);
+		metrics_sock = PGINVALID_SOCKET;
+		goto fail;
+	}
+
+	metrics_sock_target = MemoryContextStrdup(TopMemoryContext, target);
+	metrics_send_failed = false;
+	if (metrics_failed_target)
+		pfree(metrics_failed_target);
+	metrics_failed_target = NULL;
+
+	return true;
+
+fail:
+	if (!retrying)
+	{
+		if (metrics_failed_target)
+			pfree(metrics_failed_target);
+		metrics_failed_target = MemoryContextStrdup(TopMemoryContext, target);
+	}
+	metrics_failed_at = now;
+
+	return false;
+}
+
+/*
+ * Report the datagrams sent to, and dropped on the way to, metrics_target.
+ */
+Datum
+pg_plan_watch_metrics_sink(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = {0};
+
+	pws_check_available();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&pws->metrics_sent));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&pws->metrics_dropped));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,361 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch_otlp.c
+ *		  Export of captured plans as OpenTelemetry spans
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch_otlp.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "access/parallel.h"
+#include "commands/dbcommands.h"
+#include "common/pg_prng.h"
+#include "executor/instrument.h"
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "pg_plan_watch.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/*
+ * Datagram socket for a "unix:" pg_plan_watch.otlp_target, opened on first
+ * use and reopened if the setting changes.
+ */
+static pgsocket spans_sock = PGINVALID_SOCKET;
+static char *spans_sock_target = NULL;	/* target spans_sock is for */
+static bool spans_send_failed = false;	/* send error already logged */
+
+#define PW_SPANS_SNDBUF		(1024 * 1024)
+
+/* Spans of a query being exported, see AppendPlanSpans */
+typedef struct SpanExportContext
+{
+	StringInfo	buf;			/* spans written so far */
+	char		trace_id[33];	/* hex trace identifier */
+	uint64		parent_span_id; /* span of the parent node */
+	uint64		parent_end_ns;	/* end of the parent's span */
+	uint64		start_ns;		/* start of the query, in Unix nanoseconds */
+} SpanExportContext;
+
+static bool AppendPlanSpans(PlanState *planstate, void *context);
+static void AppendSpan(SpanExportContext *sctx, uint64 span_id,
+					   const char *name, uint64 start_ns, uint64 end_ns);
+static void AppendSpanAttribute(StringInfo buf, const char *key,
+								const char *type, const char *value);
+static bool ParseTraceParent(const char *str, char *trace_id,
+							 uint64 *span_id);
+static void WriteSpans(const char *data, int len);
+static bool OpenSpansSocket(void);
+
+/*
+ * Export the analyzed plan of a captured query as OTLP/JSON spans: one span
+ * for the query, and one per plan node under the span of its parent.
+ *
+ * Per-node start times are not measured, so node spans start with the
+ * query and last as long as the node's total time over all loops, cut off
+ * at the end of the parent's span.  Time summed over parallel workers, or
+ * over loops interleaved with the parent's, can exceed the parent's.
+ */
+void
+ExportPlanSpans(QueryDesc *queryDesc)
+{
+	SpanExportContext sctx;
+	StringInfoData buf;
+	TimestampTz now = GetCurrentTimestamp();
+	uint64		end_ns;
+	uint64		query_span_id;
+	uint64		context_span_id = 0;
+	char	   *name;
+
+	if (IsParallelWorker())
+		return;
+
+	/* Take the trace context from the setting, or from application_name */
+	if (!ParseTraceParent(pg_plan_watch_trace_context, sctx.trace_id,
+						  &context_span_id) &&
+		!ParseTraceParent(application_name, sctx.trace_id, &context_span_id))
+		snprintf(sctx.trace_id, sizeof(sctx.trace_id), "%016llx%016llx",
+				 (unsigned long long) pg_prng_uint64(&pg_global_prng_state),
+				 (unsigned long long) pg_prng_uint64(&pg_global_prng_state));
+
+	end_ns = (uint64) (now + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) *
+					   SECS_PER_DAY * USECS_PER_SEC) * 1000;
+	sctx.start_ns = end_ns - (uint64) (queryDesc->totaltime->total * 1e9);
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[");
+	AppendSpanAttribute(&buf, "service.name", "stringValue", "postgresql");
+	if (MyDatabaseId != InvalidOid)
+		AppendSpanAttribute(&buf, "db.namespace", "stringValue",
+							get_database_name(MyDatabaseId));
+	appendStringInfoString(&buf, "]},\"scopeSpans\":[{\"scope\":{\"name\":\"pg_plan_watch\"},\"spans\":[");
+
+	sctx.buf = &buf;
+	sctx.parent_span_id = context_span_id;
+	query_span_id = pg_prng_uint64(&pg_global_prng_state);
+	name = psprintf("query " INT64_FORMAT, queryDesc->plannedstmt->queryId);
+	AppendSpan(&sctx, query_span_id, name, sctx.start_ns, end_ns);
+	AppendSpanAttribute(&buf, "db.system.name", "stringValue", "postgresql");
+	AppendSpanAttribute(&buf, "db.query.id", "intValue",
+						psprintf(INT64_FORMAT, queryDesc->plannedstmt->queryId));
+	AppendSpanAttribute(&buf, "db.response.returned_rows", "intValue",
+						psprintf(UINT64_FORMAT, queryDesc->estate->es_processed));
+	appendStringInfoString(&buf, "]}");
+
+	sctx.parent_span_id = query_span_id;
+	sctx.parent_end_ns = end_ns;
+	AppendPlanSpans(queryDesc->planstate, &sctx);
+
+	appendStringInfoString(&buf, "]}]}]}\n");
+
+	WriteSpans(buf.data, buf.len);
+	pfree(buf.data);
+}
+
+/*
+ * Append the span of a plan node and of its children.
+ */
+static bool
+AppendPlanSpans(PlanState *planstate, void *context)
+{
+	SpanExportContext *sctx = (SpanExportContext *) context;
+	Instrumentation *instr = planstate->instrument;
+	Plan	   *plan = planstate->plan;
+	uint64		parent_span_id = sctx->parent_span_id;
+	uint64		parent_end_ns = sctx->parent_end_ns;
+	uint64		span_id = pg_prng_uint64(&pg_global_prng_state);
+	double		total = (instr && instr->need_timer) ? instr->total : 0;
+	uint64		end_ns;
+
+	end_ns = Min(sctx->start_ns + (uint64) (total * 1e9), parent_end_ns);
+
+	AppendSpan(sctx, span_id, DescribePlanNode(planstate), sctx->start_ns,
+			   end_ns);
+	AppendSpanAttribute(sctx->buf, "pg.plan_node_id", "intValue",
+						psprintf("%d", plan->plan_node_id));
+	AppendSpanAttribute(sctx->buf, "pg.plan.rows", "doubleValue",
+						psprintf("%.0f", plan->plan_rows));
+	AppendSpanAttribute(sctx->buf, "pg.plan.total_cost", "doubleValue",
+						psprintf("%.2f", plan->total_cost));
+	if (instr)
+	{
+		AppendSpanAttribute(sctx->buf, "pg.actual.rows", "doubleValue",
+							psprintf("%.0f", instr->ntuples));
+		AppendSpanAttribute(sctx->buf, "pg.actual.loops", "doubleValue",
+							psprintf("%.0f", instr->nloops));
+		if (instr->need_timer)
+		{
+			AppendSpanAttribute(sctx->buf, "pg.actual.startup_time_ms", "doubleValue",
+								psprintf("%.3f", instr->startup * 1000.0));
+			AppendSpanAttribute(sctx->buf, "pg.actual.total_time_ms", "doubleValue",
+								psprintf("%.3f", instr->total * 1000.0));
+		}
+	}
+	appendStringInfoString(sctx->buf, "]}");
+
+	sctx->parent_span_id = span_id;
+	sctx->parent_end_ns = end_ns;
+	planstate_tree_walker(planstate, AppendPlanSpans, context);
+	sctx->parent_span_id = parent_span_id;
+	sctx->parent_end_ns = parent_end_ns;
+
+	return false;
+}
+
+/*
+ * Append the beginning of a span, leaving its attribute array open.
+ */
+static void
+AppendSpan(SpanExportContext *sctx, uint64 span_id, const char *name,
+		   uint64 start_ns, uint64 end_ns)
+{
+	StringInfo	buf = sctx->buf;
+
+	if (buf->data[buf->len - 1] == '}')
+		appendStringInfoChar(buf, ',');
+	appendStringInfo(buf, "{\"traceId\":\"%s\",\"spanId\":\"%016llx\",",
+					 sctx->trace_id, (unsigned long long) span_id);
+	if (sctx->parent_span_id != 0)
+		appendStringInfo(buf, "\"parentSpanId\":\"%016llx\",",
+						 (unsigned long long) sctx->parent_span_id);
+	appendStringInfoString(buf, "\"name\":");
+	escape_json(buf, name);
+	appendStringInfo(buf, ",\"kind\":1,\"startTimeUnixNano\":\"" UINT64_FORMAT "\",\"endTimeUnixNano\":\"" UINT64_FORMAT "\",\"attributes\":[",
+					 start_ns, end_ns);
+}
+
+/*
+ * Append an attribute to an open attribute array.  value is given as text;
+ * OTLP/JSON wants intValue as a string too, and doubleValue as a number.
+ */
+static void
+AppendSpanAttribute(StringInfo buf, const char *key, const char *type,
+					const char *value)
+{
+	if (buf->data[buf->len - 1] != '[')
+		appendStringInfoChar(buf, ',');
+	appendStringInfoString(buf, "{\"key\":");
+	escape_json(buf, key);
+	appendStringInfo(buf, ",\"value\":{\"%s\":", type);
+	if (strcmp(type, "doubleValue") == 0)
+		appendStringInfoString(buf, value);
+	else
+		escape_json(buf, value);
+	appendStringInfoString(buf, "}}");
+}
+
+/*
+ * Look for a W3C traceparent ("00-<trace-id>-<parent-id>-<flags>") in a
+ * string, and extract its trace and parent identifiers.
+ */
+static bool
+ParseTraceParent(const char *str, char *trace_id, uint64 *span_id)
+{
+	const char *p;
+
+	if (str == NULL)
+		return false;
+
+	for (p = strstr(str, "00-"); p != NULL; p = strstr(p + 1, "00-"))
+	{
+		int			i;
+
+		if (strlen(p) < 55 || p[35] != '-' || p[52] != '-')
+			continue;
+		for (i = 3; i < 52; i++)
+		{
+			if (i != 35 && !isxdigit((unsigned char) p[i]))
+				break;
+		}
+		if (i < 52)
+			continue;
+
+		memcpy(trace_id, p + 3, 32);
+		trace_id[32] = '\0';
+		*span_id = strtou64(p + 36, NULL, 16);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Write exported spans to pg_plan_watch.otlp_target.  Failures are logged
+ * and otherwise ignored.
+ *
+ * A collector socket gets one datagram per request, sent without waiting:
+ * if the collector falls behind, the spans are dropped, as statsd metrics
+ * are.
+ */
+static void
+WriteSpans(const char *data, int len)
+{
+	const char *target = pg_plan_watch_otlp_target;
+
+	if (strncmp(target, "unix:", 5) == 0)
+	{
+		struct sockaddr_un addr;
+
+		if (!OpenSpansSocket())
+			return;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strlcpy(addr.sun_path, target + 5, sizeof(addr.sun_path));
+
+		/* If the collector is behind, the spans are just dropped */
+		if (sendto(spans_sock, data, len, 0,
+				   (struct sockaddr *) &addr, sizeof(addr)) >= 0)
+			spans_send_failed = false;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK && !spans_send_failed)
+		{
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("could not send spans to \"%s\": %m",
+							target + 5)));
+			spans_send_failed = true;
+		}
+	}
+	else
+	{
+		int			fd;
+
+		fd = OpenTransientFile(target, O_WRONLY | O_APPEND | O_CREAT | PG_BINARY);
+		if (fd < 0)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open span file \"%s\": %m", target)));
+			return;
+		}
+
+		/* One write, so that lines from several backends don't interleave */
+		if (write(fd, data, len) != len)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not write span file \"%s\": %m", target)));
+
+		CloseTransientFile(fd);
+	}
+}
+
+/*
+ * Make sure spans_sock is open for the current otlp_target.  Returns false
+ * if it can't be.
+ */
+static bool
+OpenSpansSocket(void)
+{
+	const char *target = pg_plan_watch_otlp_target;
+	int			sndbuf = PW_SPANS_SNDBUF;
+
+	if (spans_sock_target != NULL && strcmp(spans_sock_target, target) == 0)
+		return true;
+
+	if (spans_sock != PGINVALID_SOCKET)
+		closesocket(spans_sock);
+	spans_sock = PGINVALID_SOCKET;
+	if (spans_sock_target)
+		pfree(spans_sock_target);
+	spans_sock_target = NULL;
+
+	spans_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (spans_sock == PGINVALID_SOCKET)
+	{
+		ereport(LOG,
+				(errcode_for_socket_access(),
+				 errmsg("could not create socket for spans: %m")));
+		return false;
+	}
+
+	if (!pg_set_noblock(spans_sock))
+	{
+		ereport(LOG,
+				(errcode_for_socket_access(),
+				 errmsg("could not set span socket to nonblocking mode: %m")));
+		closesocket(spans_sock);
+		spans_sock = PGINVALID_SOCKET;
+		return false;
+	}
+
+	/* Room for the spans of large plans; the kernel may give less */
+	(void) setsockopt(spans_sock, SOL_SOCKET, SO_SNDBUF,
+					  (char *) &sndbuf, sizeof(sndbuf));
+
+	spans_sock_target = MemoryContextStrdup(TopMemoryContext, target);
+	spans_send_failed = false;
+
+	return true;
+}
@@ -0,0 +1,426 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch_persist.c
+ *		  Background worker persisting captured plans into a table
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch_persist.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "access/relation.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "partitioning/partbounds.h"
+#include "partitioning/partdesc.h"
+#include "pg_plan_watch.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+static int	PersistQueuedCaptures(void);
+static void InsertCaptures(const char *table, pwsCaptureRecord *records,
+						   int nrecords);
+static void DropExpiredCaptures(void);
+static void pws_persist_worker_detach(int code, Datum arg);
+
+PG_FUNCTION_INFO_V1(pg_plan_watch_capture_queue);
+
+/*
+ * Hand a captured plan to the persisting worker.  The worker is woken once
+ * the queue is half full; otherwise it picks captures up every naptime, so
+ * that they are inserted in batches.
+ */
+void
+QueueCapture(QueryDesc *queryDesc, const char *plan)
+{
+	pwsCaptureRecord *record;
+	PGPROC	   *worker = NULL;
+	uint64		queued;
+
+	if (IsParallelWorker())
+		return;
+
+	LWLockAcquire(pws->queue_lock, LW_EXCLUSIVE);
+
+	if (pws_queue->head - pws_queue->tail >= pg_plan_watch_persist_queue_size)
+	{
+		pws_queue->dropped++;
+		LWLockRelease(pws->queue_lock);
+		return;
+	}
+
+	record = &pws_queue->records[pws_queue->head % pg_plan_watch_persist_queue_size];
+	record->captured_at = GetCurrentTimestamp();
+	record->dbid = MyDatabaseId;
+	record->userid = GetUserId();
+	record->queryid = queryDesc->plannedstmt->queryId;
+	record->duration = queryDesc->totaltime->total * 1000.0;
+	strlcpy(record->plan, plan,
+			pg_mbcliplen(plan, strlen(plan), PWS_CAPTURE_PLAN_LEN - 1) + 1);
+	pws_queue->head++;
+
+	queued = pws_queue->head - pws_queue->tail;
+	if (queued >= pg_plan_watch_persist_queue_size / 2)
+		worker = pws_queue->worker;
+
+	LWLockRelease(pws->queue_lock);
+
+	if (worker)
+		SetLatch(&worker->procLatch);
+}
+
+/*
+ * Main entry point of the background worker persisting captures.
+ */
+void
+pg_plan_watch_persist_main(Datum main_arg)
+{
+	TimestampTz last_retention = 0;
+	uint64		left;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	am_persist_worker = true;
+
+	BackgroundWorkerInitializeConnection(pg_plan_watch_persist_database,
+										 NULL, 0);
+
+	if (!pws || !pws_queue)
+		proc_exit(0);
+
+	LWLockAcquire(pws->queue_lock, LW_EXCLUSIVE);
+	pws_queue->worker = MyProc;
+	LWLockRelease(pws->queue_lock);
+	before_shmem_exit(pws_persist_worker_detach, (Datum) 0);
+
+	while (!ShutdownRequestPending)
+	{
+		/* Keep going while full batches are waiting */
+		if (PersistQueuedCaptures() < pws_persist_batch_size())
+			(void) WaitLatch(MyLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 pg_plan_watch_persist_naptime,
+							 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Look for expired partitions once an hour */
+		if (TimestampDifferenceExceeds(last_retention, GetCurrentTimestamp(),
+									   SECS_PER_HOUR * 1000))
+		{
+			DropExpiredCaptures();
+			last_retention = GetCurrentTimestamp();
+		}
+	}
+
+	/*
+	 * Persist what was queued when we were asked to stop, but don't chase
+	 * backends that keep queueing meanwhile.
+	 */
+	LWLockAcquire(pws->queue_lock, LW_SHARED);
+	left = pws_queue->head - pws_queue->tail;
+	LWLockRelease(pws->queue_lock);
+
+	while (left > 0)
+	{
+		int			persisted = PersistQueuedCaptures();
+
+		if (persisted == 0)
+			break;
+		left -= Min(left, (uint64) persisted);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * before_shmem_exit callback: stop backends from waking a worker that is
+ * gone.
+ */
+static void
+pws_persist_worker_detach(int code, Datum arg)
+{
+	LWLockAcquire(pws->queue_lock, LW_EXCLUSIVE);
+	if (pws_queue->worker == MyProc)
+		pws_queue->worker = NULL;
+	LWLockRelease(pws->queue_lock);
+}
+
+/*
+ * Persist a batch of queued captures, in one transaction.  Returns the
+ * number of captures taken from the queue.
+ *
+ * An error loses the captures taken; the worker is then restarted.
+ */
+static int
+PersistQueuedCaptures(void)
+{
+	pwsCaptureRecord *records;
+	uint64		tail;
+	int			nrecords;
+	char	   *table;
+
+	LWLockAcquire(pws->queue_lock, LW_SHARED);
+	tail = pws_queue->tail;
+	nrecords = (int) Min(pws_queue->head - tail, pws_persist_batch_size());
+	LWLockRelease(pws->queue_lock);
+
+	if (nrecords == 0)
+		return 0;
+
+	/*
+	 * Take a copy of the batch, so that backends don't wait on the inserts.
+	 * Backends only write past the head, and don't reuse these records
+	 * until the tail moves, so they are copied without the lock.
+	 */
+	records = palloc(sizeof(pwsCaptureRecord) * nrecords);
+	for (int i = 0; i < nrecords; i++)
+		memcpy(&records[i],
+			   &pws_queue->records[(tail + i) % pg_plan_watch_persist_queue_size],
+			   sizeof(pwsCaptureRecord));
+
+	LWLockAcquire(pws->queue_lock, LW_EXCLUSIVE);
+	pws_queue->tail += nrecords;
+	LWLockRelease(pws->queue_lock);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "persisting captured plans");
+
+	table = GetCapturesTable();
+	if (table == NULL)
+		ereport(WARNING,
+				(errmsg("pg_plan_watch persister discarded %d captures", nrecords),
+				 errdetail("Extension \"pg_plan_watch\" is not installed in database \"%s\".",
+						   pg_plan_watch_persist_database)));
+	else
+		InsertCaptures(table, records, nrecords);
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	pfree(records);
+
+	return nrecords;
+}
+
+/*
+ * Insert captures into the captures table, as a single INSERT over arrays,
+ * after creating the daily partitions they need.
+ */
+static void
+InsertCaptures(const char *table, pwsCaptureRecord *records, int nrecords)
+{
+	Datum	   *captured_at = palloc(sizeof(Datum) * nrecords);
+	Datum	   *dbids = palloc(sizeof(Datum) * nrecords);
+	Datum	   *userids = palloc(sizeof(Datum) * nrecords);
+	Datum	   *queryids = palloc(sizeof(Datum) * nrecords);
+	Datum	   *durations = palloc(sizeof(Datum) * nrecords);
+	Datum	   *plans = palloc(sizeof(Datum) * nrecords);
+	Datum		args[6];
+	Oid			argtypes[6] = {TIMESTAMPTZARRAYOID, OIDARRAYOID, OIDARRAYOID,
+							   INT8ARRAYOID, FLOAT8ARRAYOID, TEXTARRAYOID};
+	SPITupleTable *tuptable;
+	uint64		ncreate;
+
+	for (int i = 0; i < nrecords; i++)
+	{
+		captured_at[i] = TimestampTzGetDatum(records[i].captured_at);
+		dbids[i] = ObjectIdGetDatum(records[i].dbid);
+		userids[i] = ObjectIdGetDatum(records[i].userid);
+		queryids[i] = Int64GetDatum(records[i].queryid);
+		durations[i] = Float8GetDatum(records[i].duration);
+		plans[i] = CStringGetTextDatum(records[i].plan);
+	}
+	args[0] = PointerGetDatum(construct_array(captured_at, nrecords, TIMESTAMPTZOID,
+											  sizeof(TimestampTz), FLOAT8PASSBYVAL,
+											  TYPALIGN_DOUBLE));
+	args[1] = PointerGetDatum(construct_array_builtin(dbids, nrecords, OIDOID));
+	args[2] = PointerGetDatum(construct_array_builtin(userids, nrecords, OIDOID));
+	args[3] = PointerGetDatum(construct_array_builtin(queryids, nrecords, INT8OID));
+	args[4] = PointerGetDatum(construct_array_builtin(durations, nrecords, FLOAT8OID));
+	args[5] = PointerGetDatum(construct_array_builtin(plans, nrecords, TEXTOID));
+
+	/* Create the partitions of the days covered */
+	if (SPI_execute_with_args(psprintf("SELECT format('CREATE TABLE IF NOT EXISTS %%I.%%I PARTITION OF %%s FOR VALUES FROM (%%L) TO (%%L)', "
+									   "n.nspname, c.relname || '_' || to_char(d, 'YYYYMMDD'), c.oid::regclass, d, d + interval '1 day') "
+									   "FROM (SELECT DISTINCT date_trunc('day', t) AS d FROM unnest($1) t) s, "
+									   "pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+									   "WHERE c.oid = %s::regclass",
+									   quote_literal_cstr(table)),
+							  1, argtypes, args, NULL, false, 0) != SPI_OK_SELECT)
+		elog(ERROR, "could not list partitions needed by %s", table);
+
+	tuptable = SPI_tuptable;
+	ncreate = SPI_processed;
+	for (uint64 i = 0; i < ncreate; i++)
+	{
+		char	   *ddl = SPI_getvalue(tuptable->vals[i], tuptable->tupdesc, 1);
+
+		if (SPI_execute(ddl, false, 0) != SPI_OK_UTILITY)
+			elog(ERROR, "could not create partition: %s", ddl);
+	}
+
+	if (SPI_execute_with_args(psprintf("INSERT INTO %s (captured_at, dbid, userid, queryid, duration, plan) "
+									   "SELECT * FROM unnest($1, $2, $3, $4, $5, $6)",
+									   table),
+							  6, argtypes, args, NULL, false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "could not insert into %s", table);
+}
+
+/*
+ * Drop the partitions of the captures table whose upper bound is older than
+ * pg_plan_watch.persist_retention.  Partitions are found by their bounds in
+ * the table's partition descriptor, whatever their names.
+ */
+static void
+DropExpiredCaptures(void)
+{
+	char	   *table;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "dropping expired captured plans");
+
+	table = GetCapturesTable();
+	if (table != NULL)
+	{
+		Oid			relid;
+		Relation	rel;
+		PartitionDesc partdesc;
+		PartitionBoundInfo boundinfo;
+		TimestampTz cutoff;
+		List	   *expired = NIL;
+
+		relid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+													 CStringGetDatum(table)));
+		cutoff = GetCurrentTimestamp() -
+			(TimestampTz) pg_plan_watch_persist_retention * USECS_PER_DAY;
+
+		rel = relation_open(relid, AccessShareLock);
+		partdesc = RelationGetPartitionDesc(rel, true);
+		boundinfo = partdesc->boundinfo;
+
+		/* datums[i] is the upper bound of the partition indexes[i] */
+		if (boundinfo && boundinfo->strategy == PARTITION_STRATEGY_RANGE)
+		{
+			for (int i = 0; i < boundinfo->ndatums; i++)
+			{
+				int			part = boundinfo->indexes[i];
+
+				if (part < 0 ||
+					boundinfo->kind[i][0] != PARTITION_RANGE_DATUM_VALUE)
+					continue;
+				if (DatumGetTimestampTz(boundinfo->datums[i][0]) <= cutoff)
+					expired = lappend_oid(expired, partdesc->oids[part]);
+			}
+		}
+
+		/* Keep the lock until commit */
+		relation_close(rel, NoLock);
+
+		foreach_oid(partid, expired)
+		{
+			char	   *ddl;
+
+			ddl = psprintf("DROP TABLE %s",
+						   quote_qualified_identifier(get_namespace_name(get_rel_namespace(partid)),
+													  get_rel_name(partid)));
+			if (SPI_execute(ddl, false, 0) != SPI_OK_UTILITY)
+				elog(ERROR, "could not drop partition: %s", ddl);
+		}
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Return the qualified name of the captures table, or NULL if the extension
+ * is not installed in this database.  Must be called with SPI connected.
+ */
+char *
+GetCapturesTable(void)
+{
+	bool		isnull;
+	Datum		nspname;
+
+	if (SPI_execute("SELECT quote_ident(n.nspname) FROM pg_extension e "
+					"JOIN pg_namespace n ON n.oid = e.extnamespace "
+					"WHERE e.extname = 'pg_plan_watch'",
+					true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not look up extension pg_plan_watch");
+
+	if (SPI_processed == 0)
+		return NULL;
+
+	nspname = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+							&isnull);
+	return psprintf("%s.pg_plan_watch_captures", TextDatumGetCString(nspname));
+}
+
+/*
+ * Report the captures waiting to be persisted, and those dropped because
+ * the queue was full.
+ */
+Datum
+pg_plan_watch_capture_queue(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = {0};
+
+	pws_check_available();
+
+	if (pws_queue == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_watch captures are not persisted"),
+				 errhint("Set \"pg_plan_watch.persist_database\" and restart the server.")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	LWLockAcquire(pws->queue_lock, LW_SHARED);
+	values[0] = Int64GetDatum((int64) (pws_queue->head - pws_queue->tail));
+	values[1] = Int64GetDatum((int64) pws_queue->dropped);
+	LWLockRelease(pws->queue_lock);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,349 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_plan_watch_ring.c
+ *		  Ring of captured plans in a memory-mapped file
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_plan_watch/pg_plan_watch_ring.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "pg_plan_watch.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+/*
+ * Capture file: a fixed-size ring of captures in a file that backends map
+ * and write into directly, so that an agent can follow captures by mapping
+ * the same file, without a connection to the server.
+ *
+ * The file is a header of PWS_RING_HEADER_SIZE bytes followed by nslots
+ * slots of PWS_RING_SLOT_SIZE bytes.  All integers are in the server's
+ * native byte order.  The header is:
+ *
+ *	offset	0	char[8]	magic, "PWSRING" and a NUL
+ *	offset	8	uint32	layout version, 1
+ *	offset	12	uint32	header size
+ *	offset	16	uint32	slot size
+ *	offset	20	uint32	number of slots
+ *	offset	24	uint64	next sequence number to be reserved
+ *	offset	32	uint64	records skipped because their slot was busy
+ *
+ * and each slot:
+ *
+ *	offset	0	uint64	sequence number of the record in the slot
+ *	offset	8	int64	end of the query, in microseconds since the Unix epoch
+ *	offset	16	int64	query identifier
+ *	offset	24	float8	duration, in msec
+ *	offset	32	uint32	database OID
+ *	offset	36	uint32	user OID
+ *	offset	40	uint32	length of the plan in bytes
+ *	offset	44	uint32	unused
+ *	offset	48	char[]	plan, not NUL-terminated, cut to fit in the slot
+ *
+ * Sequence numbers start at 1, and record N lives in slot N % nslots.  A
+ * writer reserves N by an atomic fetch-and-add on the header, marks the
+ * slot busy (PWS_RING_SEQ_BUSY), fills it in and then stores N in it.  An
+ * empty slot holds 0.  A reader wanting record N checks that the slot
+ * holds N, reads the record and checks again: anything else means the
+ * record is not written yet (0, busy or lower) or was overwritten (higher).
+ *
+ * A writer that finds its slot busy with another lap of the ring skips its
+ * record, counting it in the header, and record N then never shows up.  A
+ * reader waiting on N should therefore give up on it once next_seq is past
+ * N and skipped has grown since it started waiting, or after a timeout.
+ *
+ * The header is kept across restarts when the geometry is unchanged, so
+ * readers can carry on from where they were.  The file's blocks are
+ * allocated up front.
+ */
+#define PWS_RING_MAGIC			"PWSRING"
+#define PWS_RING_VERSION		1
+#define PWS_RING_HEADER_SIZE	4096
+#define PWS_RING_SLOT_SIZE		8192
+#define PWS_RING_SEQ_BUSY		PG_UINT64_MAX
+
+struct pwsRingHeader
+{
+	char		magic[8];
+	uint32		version;
+	uint32		header_size;
+	uint32		slot_size;
+	uint32		nslots;
+	pg_atomic_uint64 next_seq;	/* next sequence number to reserve */
+	pg_atomic_uint64 skipped;	/* records not written, slot being busy */
+};
+
+typedef struct pwsRingSlot
+{
+	pg_atomic_uint64 seq;		/* record in the slot, 0 or busy */
+	int64		captured_at;	/* in usec since the Unix epoch */
+	int64		queryid;		/* query identifier */
+	double		duration;		/* in msec */
+	uint32		dbid;			/* database OID */
+	uint32		userid;			/* user OID */
+	uint32		plan_len;		/* bytes of plan */
+	uint32		unused;
+	char		plan[FLEXIBLE_ARRAY_MEMBER];	/* rendered plan */
+} pwsRingSlot;
+
+/* The layout is read by other programs, so the atomics must be plain */
+StaticAssertDecl(sizeof(pg_atomic_uint64) == sizeof(uint64),
+				 "capture file needs native 64-bit atomics");
+StaticAssertDecl(offsetof(pwsRingHeader, skipped) == 32,
+				 "capture file header layout changed");
+StaticAssertDecl(offsetof(pwsRingSlot, plan) == 48,
+				 "capture file slot layout changed");
+
+#define PWS_RING_PLAN_LEN	(PWS_RING_SLOT_SIZE - offsetof(pwsRingSlot, plan))
+
+/* Mapping of the capture file, NULL if there is none */
+pwsRingHeader *pws_ring = NULL;
+static Size pws_ring_size = 0;
+
+static bool AllocateCaptureFile(int fd, Size size, bool resize);
+
+PG_FUNCTION_INFO_V1(pg_plan_watch_capture_file);
+
+/*
+ * Map the capture file, creating or resetting it as needed.  The postmaster
+ * sets the file up, and backends inherit its mapping; in EXEC_BACKEND
+ * builds they map it again here.  Problems are logged, and leave the
+ * capture file off.
+ */
+void
+MapCaptureFile(void)
+{
+	int			fd;
+	struct stat st;
+	Size		size;
+	pwsRingHeader *header;
+	bool		valid;
+
+	if (pws_ring)
+	{
+		munmap(pws_ring, pws_ring_size);
+		pws_ring = NULL;
+	}
+
+	size = add_size(PWS_RING_HEADER_SIZE,
+					mul_size(pg_plan_watch_capture_file_slots, PWS_RING_SLOT_SIZE));
+
+	fd = OpenTransientFile(pg_plan_watch_capture_file, O_RDWR | O_CREAT | PG_BINARY);
+	if (fd < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m",
+						pg_plan_watch_capture_file)));
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+		(!IsUnderPostmaster &&
+		 !AllocateCaptureFile(fd, size, (Size) st.st_size != size)))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not allocate %zu bytes for file \"%s\": %m",
+						size, pg_plan_watch_capture_file)));
+		CloseTransientFile(fd);
+		return;
+	}
+
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (header == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m",
+						pg_plan_watch_capture_file)));
+		return;
+	}
+
+	pws_ring = header;
+	pws_ring_size = size;
+
+	if (IsUnderPostmaster)
+		return;
+
+	/*
+	 * Keep the records of a file of the same geometry, but free the slots of
+	 * writes a crash interrupted.
+	 */
+	valid = (memcmp(header->magic, PWS_RING_MAGIC, sizeof(header->magic)) == 0 &&
+			 header->version == PWS_RING_VERSION &&
+			 header->header_size == PWS_RING_HEADER_SIZE &&
+			 header->slot_size == PWS_RING_SLOT_SIZE &&
+			 header->nslots == pg_plan_watch_capture_file_slots);
+
+	for (int i = 0; i < pg_plan_watch_capture_file_slots; i++)
+	{
+		pwsRingSlot *slot = (pwsRingSlot *) ((char *) header + PWS_RING_HEADER_SIZE +
+											 (Size) i * PWS_RING_SLOT_SIZE);
+
+		if (!valid || pg_atomic_read_u64(&slot->seq) == PWS_RING_SEQ_BUSY)
+			pg_atomic_init_u64(&slot->seq, 0);
+	}
+
+	if (!valid)
+	{
+		memset(header, 0, PWS_RING_HEADER_SIZE);
+		header->version = PWS_RING_VERSION;
+		header->header_size = PWS_RING_HEADER_SIZE;
+		header->slot_size = PWS_RING_SLOT_SIZE;
+		header->nslots = pg_plan_watch_capture_file_slots;
+		pg_atomic_init_u64(&header->next_seq, 1);
+		pg_atomic_init_u64(&header->skipped, 0);
+		pg_write_barrier();
+		memcpy(header->magic, PWS_RING_MAGIC, sizeof(header->magic));
+	}
+}
+
+/*
+ * Give the capture file its size, with its blocks allocated: a write into
+ * a hole of a mapped file that can't be allocated raises SIGBUS rather than
+ * an error.  Without posix_fallocate() the file is written with zeros, when
+ * resized.  Returns false, with errno set, on failure.
+ */
+static bool
+AllocateCaptureFile(int fd, Size size, bool resize)
+{
+#if defined(HAVE_POSIX_FALLOCATE) && defined(__linux__)
+	int			rc;
+
+	if (resize && ftruncate(fd, size) < 0)
+		return false;
+
+	do
+	{
+		rc = posix_fallocate(fd, 0, size);
+	} while (rc == EINTR);
+
+	if (rc != 0)
+	{
+		errno = rc;
+		return false;
+	}
+#else
+	PGAlignedBlock zbuffer;
+
+	if (!resize)
+		return true;
+
+	if (ftruncate(fd, 0) < 0)
+		return false;
+
+	memset(zbuffer.data, 0, BLCKSZ);
+	for (Size offset = 0; offset < size; offset += BLCKSZ)
+	{
+		Size		len = Min(BLCKSZ, size - offset);
+
+		errno = 0;
+		if (pg_pwrite(fd, zbuffer.data, len, offset) != (ssize_t) len)
+		{
+			/* if write didn't set errno, assume problem is no disk space */
+			if (errno == 0)
+				errno = ENOSPC;
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+/*
+ * Write a captured plan into the capture file.
+ *
+ * The record is skipped if a writer that reserved an older or newer lap of
+ * the same slot is still at it; that takes the ring wrapping around during
+ * a single write.
+ */
+void
+WriteCaptureFile(QueryDesc *queryDesc, const char *plan)
+{
+	uint64		seq;
+	uint64		old;
+	pwsRingSlot *slot;
+	int			len;
+
+	/* The leader writes the capture of the whole query */
+	if (IsParallelWorker())
+		return;
+
+	seq = pg_atomic_fetch_add_u64(&pws_ring->next_seq, 1);
+	slot = (pwsRingSlot *) ((char *) pws_ring + PWS_RING_HEADER_SIZE +
+							(seq % pg_plan_watch_capture_file_slots) * PWS_RING_SLOT_SIZE);
+
+	old = pg_atomic_read_u64(&slot->seq);
+	do
+	{
+		if (old == PWS_RING_SEQ_BUSY || old > seq)
+		{
+			pg_atomic_fetch_add_u64(&pws_ring->skipped, 1);
+			return;
+		}
+	} while (!pg_atomic_compare_exchange_u64(&slot->seq, &old, PWS_RING_SEQ_BUSY));
+
+	len = pg_mbcliplen(plan, strlen(plan), PWS_RING_PLAN_LEN);
+
+	slot->captured_at = GetCurrentTimestamp() +
+		(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+	slot->queryid = queryDesc->plannedstmt->queryId;
+	slot->duration = queryDesc->totaltime->total * 1000.0;
+	slot->dbid = MyDatabaseId;
+	slot->userid = GetUserId();
+	slot->plan_len = len;
+	slot->unused = 0;
+	memcpy(slot->plan, plan, len);
+
+	/* Publish the record once it is complete */
+	pg_write_barrier();
+	pg_atomic_write_u64(&slot->seq, seq);
+}
+
+/*
+ * Report the state of the capture file: its path and slots, the next
+ * sequence number, and the records skipped.
+ */
+Datum
+pg_plan_watch_capture_file(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4] = {0};
+
+	pws_check_available();
+
+	if (pws_ring == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_watch capture file is not in use"),
+				 errhint("Set \"pg_plan_watch.capture_file\" and restart the server.")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = CStringGetTextDatum(pg_plan_watch_capture_file);
+	values[1] = Int32GetDatum(pws_ring->nslots);
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&pws_ring->next_seq));
+	values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&pws_ring->skipped));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
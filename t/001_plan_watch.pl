@@ -0,0 +1,735 @@
+
+# Copyright (c) 2025, PostgreSQL Global Development Group
+
+use strict;
+use warnings FATAL => 'all';
+
+use IO::Select;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use JSON::PP;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Runs the specified query and returns the emitted server log.
+# params is an optional hash mapping GUC names to values;
+# any such settings are transmitted to the backend via PGOPTIONS.
+sub query_log
+{
+	my ($node, $sql, $params) = @_;
+	$params ||= {};
+
+	local $ENV{PGOPTIONS} = join " ",
+	  map { "-c $_=$params->{$_}" } keys %$params;
+
+	my $log = $node->logfile();
+	my $offset = -s $log;
+
+	$node->safe_psql("postgres", $sql);
+
+	return slurp_file($log, $offset);
+}
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf('postgresql.conf',
+	"shared_preload_libraries = 'pg_plan_watch'");
+$node->start;
+
+my $log_contents;
+
+# Foreign scan whose rows are mostly discarded by a local filter, through a
+# loopback postgres_fdw server.
+my $host = $node->host;
+my $port = $node->port;
+$node->safe_psql(
+	"postgres", qq{
+CREATE EXTENSION postgres_fdw;
+CREATE SERVER loopback FOREIGN DATA WRAPPER postgres_fdw
+	OPTIONS (host '$host', port '$port', dbname 'postgres');
+CREATE USER MAPPING FOR CURRENT_USER SERVER loopback;
+CREATE TABLE remote_items (id int, val text);
+INSERT INTO remote_items SELECT i, 'val ' || i FROM generate_series(1, 10000) i;
+CREATE FOREIGN TABLE items (id int, val text)
+	SERVER loopback OPTIONS (table_name 'remote_items');
+-- Neither shipped nor inlined, so this filter runs locally
+CREATE FUNCTION is_round(int) RETURNS bool
+	LANGUAGE plpgsql IMMUTABLE AS 'BEGIN RETURN \$1 % 100 = 0; END';
+});
+
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM items WHERE is_round(id);",
+	{ "pg_plan_watch.log_foreign_pass_ratio" => "0.1" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[foreign_pass_through\]: Foreign Scan on items fetched 10000 rows, of which 100 \(1\.00%\) survived its local filter/,
+	"foreign scan with mostly discarded rows flagged");
+
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM items WHERE id % 100 = 0;",
+	{ "pg_plan_watch.log_foreign_pass_ratio" => "0.1" });
+
+unlike(
+	$log_contents,
+	qr/foreign_pass_through/,
+	"foreign scan with the filter pushed down not flagged");
+
+# Statements run by a DO block are nested in it, and summarized once.
+$node->safe_psql("postgres",
+	"CREATE TABLE loop_items AS SELECT i AS id FROM generate_series(1, 1000) i;"
+);
+
+$log_contents = query_log(
+	$node,
+	q{DO $$ BEGIN FOR i IN 1..20 LOOP PERFORM count(*) FROM loop_items; END LOOP; END $$;},
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.log_nested_statements" => "on",
+		"pg_plan_watch.log_nested_summary" => "on"
+	});
+
+like(
+	$log_contents,
+	qr/nested statements: 20 captures of 1 distinct plans\n\s*nested plan 1: captures: 20 /,
+	"DO loop summarized in one entry");
+
+my @summaries = ($log_contents =~ /nested statements:/g);
+is(scalar(@summaries), 1, "DO loop logged one summary");
+
+unlike(
+	$log_contents,
+	qr/duration: [\d.]+ ms  plan:/,
+	"DO loop statements not logged one by one");
+
+# Without the summary, statements run by a DO block stay top-level and are
+# logged one by one.
+$log_contents = query_log(
+	$node,
+	q{DO $$ BEGIN FOR i IN 1..20 LOOP PERFORM count(*) FROM loop_items; END LOOP; END $$;},
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.log_nested_statements" => "on"
+	});
+
+my @plans = ($log_contents =~ /duration: [\d.]+ ms  plan:/g);
+is(scalar(@plans), 20, "DO loop statements logged one by one without summary");
+
+unlike(
+	$log_contents,
+	qr/nested statements:/,
+	"DO loop not summarized without summary");
+
+# EXPLAIN (PLAN_WATCH) names the rules each node would trip, using the
+# planner's estimates without ANALYZE, and only for the nodes they apply to.
+my $explain = $node->safe_psql(
+	"postgres", q{
+SET pg_plan_watch.log_seqscan_threshold = 100;
+EXPLAIN (COSTS OFF, PLAN_WATCH) SELECT * FROM loop_items ORDER BY id;
+});
+
+like(
+	$explain,
+	qr/Seq Scan on loop_items\n\s+Plan Watch: no history\n\s+Plan Watch Would Trip: seqscan_threshold \(estimated\)/,
+	"EXPLAIN shows estimated seqscan threshold");
+
+my @would_trip = ($explain =~ /Would Trip/g);
+is(scalar(@would_trip), 1, "EXPLAIN flags the scan but not the sort above it");
+
+$explain = $node->safe_psql(
+	"postgres", q{
+SET pg_plan_watch.log_limit_wasted_rows = 500;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, PLAN_WATCH)
+	SELECT * FROM loop_items OFFSET 900 LIMIT 10;
+});
+
+like(
+	$explain,
+	qr/Limit \(actual rows=[\d.]+ loops=1\)\n\s+Plan Watch: no history\n\s+Plan Watch Would Trip: limit_waste\n/,
+	"EXPLAIN ANALYZE shows limit waste");
+
+# Flagged sequential scans sent as statsd datagrams to a local receiver.
+$node->safe_psql("postgres", "CREATE EXTENSION pg_plan_watch;");
+
+my $receiver = IO::Socket::INET->new(
+	Proto => 'udp',
+	LocalAddr => '127.0.0.1',
+	LocalPort => 0) or die "could not create UDP receiver: $!";
+my $receiver_port = $receiver->sockport;
+
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items;",
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.metrics_target" => "127.0.0.1:$receiver_port"
+	});
+
+my $datagram = '';
+if (IO::Select->new($receiver)
+	->can_read($PostgreSQL::Test::Utils::timeout_default))
+{
+	$receiver->recv($datagram, 65536);
+}
+like(
+	$datagram,
+	qr/^pg_plan_watch\.seqscan\.tuples:1000\|c\|#relation:loop_items,queryid:-?\d+$/m,
+	"seqscan metric received");
+
+is( $node->safe_psql(
+		"postgres", "SELECT sent, dropped FROM pg_plan_watch_metrics_sink();"),
+	"1|0",
+	"datagram counted as sent");
+
+# A missing receiver is logged once, and not counted as dropped.
+my $missing = PostgreSQL::Test::Utils::tempdir_short() . "/no_receiver";
+
+SKIP:
+{
+	skip "Unix-domain sockets not supported", 2 if $windows_os;
+
+	$log_contents = query_log(
+		$node,
+		"SELECT count(*) FROM loop_items; SELECT count(*) FROM loop_items;",
+		{
+			"pg_plan_watch.log_seqscan_threshold" => "100",
+			"pg_plan_watch.metrics_target" => "unix:$missing"
+		});
+
+	my @errors = ($log_contents =~ /could not send metrics to/g);
+	is(scalar(@errors), 1, "missing receiver logged once");
+
+	is( $node->safe_psql(
+			"postgres",
+			"SELECT sent, dropped FROM pg_plan_watch_metrics_sink();"),
+		"1|0",
+		"missing receiver not counted as dropped");
+}
+
+# Spans of a captured plan sent as one datagram to a collector socket, with
+# node spans ending no later than their parent's.
+SKIP:
+{
+	skip "Unix-domain sockets not supported", 3 if $windows_os;
+
+	my $collector_path =
+	  PostgreSQL::Test::Utils::tempdir_short() . "/collector";
+	my $collector = IO::Socket::UNIX->new(
+		Type => SOCK_DGRAM,
+		Local => $collector_path) or die "could not create collector: $!";
+
+	query_log(
+		$node,
+		"SELECT count(*) FROM loop_items;",
+		{
+			"pg_plan_watch.log_seqscan_threshold" => "100",
+			"pg_plan_watch.log_analyze" => "on",
+			"pg_plan_watch.otlp_target" => "unix:$collector_path"
+		});
+
+	my $request = '';
+	if (IO::Select->new($collector)
+		->can_read($PostgreSQL::Test::Utils::timeout_default))
+	{
+		$collector->recv($request, 1024 * 1024);
+	}
+	my $spans =
+	  eval { decode_json($request)->{resourceSpans}[0]{scopeSpans}[0]{spans} }
+	  || [];
+	my %end_of = map { $_->{spanId} => $_->{endTimeUnixNano} } @$spans;
+
+	ok((grep { $_->{name} eq 'Seq Scan on loop_items' } @$spans),
+		"span of the scan received");
+	is(scalar(grep { $_->{name} =~ /^query / } @$spans),
+		1, "one span for the query");
+	is( scalar(
+			grep {
+				defined $_->{parentSpanId}
+				  && defined $end_of{ $_->{parentSpanId} }
+				  && $_->{endTimeUnixNano} gt $end_of{ $_->{parentSpanId} }
+			} @$spans),
+		0,
+		"node spans end within their parent");
+}
+
+# An invalid target is logged once, not for every flagged scan.
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM loop_items; SELECT count(*) FROM loop_items;",
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.metrics_target" => "no_port"
+	});
+
+my @invalid = ($log_contents =~ /invalid pg_plan_watch\.metrics_target "no_port"/g);
+is(scalar(@invalid), 1, "invalid metrics target logged once");
+
+# A flagged scan of a table with dead tuples estimates the blocks wasted on
+# them, and accumulates into pg_plan_watch_bloat until reset.
+$node->safe_psql(
+	"postgres", q{
+CREATE TABLE bloated (id int) WITH (autovacuum_enabled = off);
+INSERT INTO bloated SELECT generate_series(1, 1000);
+DELETE FROM bloated WHERE id > 500;
+});
+
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM bloated;",
+	{ "pg_plan_watch.log_seqscan_threshold" => "100" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[seqscan_bloat\]: Seq Scan on bloated: 50% dead tuples \(n_live_tup=500, n_dead_tup=500\), about [\d.]+ of [\d.]+ heap blocks read were wasted, 500 rows examined/,
+	"scan of a bloated table flagged");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT scans, rows_examined FROM pg_plan_watch_bloat WHERE relid = 'bloated'::regclass;"
+	),
+	"1|500",
+	"bloated scan accumulated");
+
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+
+is($node->safe_psql("postgres", "SELECT count(*) FROM pg_plan_watch_stats();"),
+	"0", "statistics reset");
+
+# Scans of sampled queries feed the cost calibration of their tablespace,
+# one sample per scan.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items; SELECT count(*) FROM loop_items; SELECT count(*) FROM loop_items;",
+	{ "pg_plan_watch.sample_rate" => "1" });
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT spcname, samples FROM pg_plan_watch_cost_calibration;"),
+	"pg_default|3",
+	"sampled scans calibrate the default tablespace");
+
+# A correlated SubPlan run once per outer row, named with the node driving
+# it.
+$log_contents = query_log(
+	$node,
+	"SELECT (SELECT count(*) FROM loop_items b WHERE b.id = a.id) FROM loop_items a WHERE a.id <= 50;",
+	{ "pg_plan_watch.log_subplan_loops_threshold" => "10" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[subplan_loops\]: SubPlan \S+ executed 50 times by Seq Scan on loop_items, examining 50000 rows across loops \(1000 per loop\)/,
+	"correlated SubPlan flagged");
+
+is( $node->safe_psql(
+		"postgres", "SELECT loops, rows_examined FROM pg_plan_watch_subplans;"),
+	"50|50000",
+	"SubPlan loops accumulated");
+
+# A top-N sort over a sequential scan reads the whole table for a few rows,
+# and names the index that would let the scan stop early.
+$log_contents = query_log(
+	$node,
+	"SELECT * FROM loop_items ORDER BY id DESC LIMIT 5;",
+	{ "pg_plan_watch.log_limit_wasted_rows" => "500" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[limit_waste\]: Limit returned 5 of 1000 rows sorted from Seq Scan on loop_items \(200\.0 rows read per row returned\); an index on loop_items \(id\) would allow the scan to stop early/,
+	"top-N sort over a sequential scan flagged");
+
+# The same query run over and over in one transaction, as an N+1 pattern
+# does, is reported once at commit.
+$log_contents = query_log(
+	$node,
+	"BEGIN;\n"
+	  . ("SELECT id FROM loop_items WHERE id = 1;\n" x 10)
+	  . "COMMIT;",
+	{
+		"compute_query_id" => "on",
+		"pg_plan_watch.log_repeated_query_threshold" => "10"
+	});
+
+my @repeated =
+  ($log_contents =~ /query -?\d+ executed 10 times in one transaction/g);
+is(scalar(@repeated), 1, "repeated query reported once");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT occurrences, executions FROM pg_plan_watch_repeated_queries;"),
+	"1|10",
+	"repeated query accumulated");
+
+# A result set larger than the threshold is reported with its estimated size
+# and the application that fetched it.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+$log_contents = query_log(
+	$node,
+	"SELECT * FROM loop_items;",
+	{ "pg_plan_watch.log_result_rows_threshold" => "500" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[large_result\]: 1000 rows of about 4 bytes each \(4 kB\) sent to application "[^"]+"/,
+	"large result flagged");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT calls, rows, bytes FROM pg_plan_watch_large_results;"),
+	"1|1000|4000",
+	"large result accumulated");
+
+# WAL volume is reported for the statement and attributed to the relation
+# written by its ModifyTable node.
+$node->safe_psql("postgres",
+	"CREATE TABLE wal_items (id int); SELECT pg_plan_watch_reset();");
+$log_contents = query_log(
+	$node,
+	"INSERT INTO wal_items SELECT generate_series(1, 1000);",
+	{ "pg_plan_watch.log_wal_threshold" => "10" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[wal\]: query generated \d+ bytes of WAL in \d+ records, \d+ of them full page images/,
+	"WAL volume flagged");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT coalesce(relid::regclass::text, 'total'), calls FROM pg_plan_watch_wal ORDER BY 1;"
+	),
+	"total|1\nwal_items|1",
+	"WAL accumulated per statement and relation");
+
+# A sort must read all of its input before the first row can be sent, and is
+# named as the blocking node.
+$log_contents = query_log(
+	$node,
+	"SELECT * FROM loop_items ORDER BY id;",
+	{ "pg_plan_watch.log_first_row_threshold" => "0" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[first_row\]: first row sent after [\d.]+ ms; blocking nodes: Sort \(node \d+\)/,
+	"first row latency flagged with its blocking node");
+
+# A scan whose filter calls an expensive function costs more per tuple than
+# the threshold, and the function is named.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM loop_items WHERE is_round(id);",
+	{
+		"pg_plan_watch.log_analyze" => "on",
+		"pg_plan_watch.log_tuple_cost_threshold" => "1"
+	});
+
+like(
+	$log_contents,
+	qr/Plan Watch \[tuple_cost\]: Seq Scan on loop_items spent \d+ ns per tuple over 1000 tuples \([\d.]+ ms\); filter calls: is_round;/,
+	"costly tuples flagged with the functions called");
+
+is( $node->safe_psql(
+		"postgres", "SELECT calls, tuples FROM pg_plan_watch_tuple_costs;"),
+	"1|1000",
+	"tuple cost accumulated");
+
+# Calls of a user-defined function are attributed to the node whose filter
+# makes them, when a plan is captured.
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM loop_items WHERE is_round(id);",
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.track_functions" => "on"
+	});
+
+like(
+	$log_contents,
+	qr/Plan Watch \[function_calls\]: Seq Scan on loop_items: Filter calls is_round 1000 times, [\d.]+ ms/,
+	"function calls attributed to the filtering node");
+
+# A query on a partitioned table that no pruning could narrow scans every
+# partition.
+$node->safe_psql(
+	"postgres", q{
+CREATE TABLE parts (id int) PARTITION BY RANGE (id);
+DO $$ BEGIN FOR i IN 0..9 LOOP
+	EXECUTE format('CREATE TABLE parts_%s PARTITION OF parts FOR VALUES FROM (%s) TO (%s)',
+				   i, i * 100, (i + 1) * 100);
+END LOOP; END $$;
+INSERT INTO parts SELECT generate_series(0, 999);
+SELECT pg_plan_watch_reset();
+});
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM parts;",
+	{ "pg_plan_watch.log_partitions_threshold" => "5" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[partitions\]: Append \(node \d+\) scanned 10 of 10 partitions of parts \(100%\); 10 left after plan-time pruning, 10 after initial pruning, run-time pruning not available/,
+	"scan of every partition flagged");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT relid::regclass, calls, avg_partitions_scanned, avg_partitions FROM pg_plan_watch_partitions;"
+	),
+	"parts|1|10|10",
+	"partition scans accumulated");
+
+# A Memoize node planned from stale statistics that promised few distinct
+# keys finds none of them in its cache.
+$node->safe_psql(
+	"postgres", q{
+CREATE TABLE memo_outer (k int) WITH (autovacuum_enabled = off);
+INSERT INTO memo_outer SELECT i % 10 FROM generate_series(1, 1000) i;
+ANALYZE memo_outer;
+DELETE FROM memo_outer;
+INSERT INTO memo_outer SELECT generate_series(1, 1000);
+CREATE TABLE memo_inner (id int PRIMARY KEY);
+INSERT INTO memo_inner SELECT generate_series(1, 1000);
+ANALYZE memo_inner;
+SELECT pg_plan_watch_reset();
+});
+$log_contents = query_log(
+	$node,
+	"SELECT count(*) FROM memo_outer o JOIN memo_inner i ON i.id = o.k;",
+	{
+		"enable_hashjoin" => "off",
+		"enable_mergejoin" => "off",
+		"pg_plan_watch.log_memoize_hit_ratio" => "0.5"
+	});
+
+like(
+	$log_contents,
+	qr/Plan Watch \[memoize\]: Memoize \(node \d+\) hit ratio 0\.0%: 0 hits, 1000 misses, \d+ evictions, \d+ overflows, peak memory \d+ kB/,
+	"Memoize node with a poor hit ratio flagged");
+
+is( $node->safe_psql(
+		"postgres", "SELECT calls, hits, misses FROM pg_plan_watch_memoize;"),
+	"1|0|1000",
+	"Memoize statistics accumulated");
+
+# A recursive query that iterates past the threshold is reported with the
+# rows that went through its work table.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+$log_contents = query_log(
+	$node,
+	"WITH RECURSIVE t(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM t WHERE n < 100) SELECT count(*) FROM t;",
+	{ "pg_plan_watch.log_recursion_depth_threshold" => "50" });
+
+like(
+	$log_contents,
+	qr/Plan Watch \[recursion\]: Recursive Union iterated \d+ times \(recursion depth \d+\), the recursive term produced 99 intermediate rows from 1 initial rows, 100 rows returned/,
+	"deep recursion flagged");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT calls, intermediate_rows FROM pg_plan_watch_recursion;"),
+	"1|99",
+	"recursion accumulated");
+
+# Plans captured in one transaction are written as a single log entry when
+# it ends.
+$log_contents = query_log(
+	$node,
+	"BEGIN;\nSELECT count(*) FROM loop_items;\nSELECT count(*) FROM loop_items;\nCOMMIT;",
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.log_batch_size" => "64"
+	});
+
+like(
+	$log_contents,
+	qr/2 captured plans:\ncapture 1: duration: [\d.]+ ms  plan:\n/,
+	"captures of a transaction batched");
+
+my @batches = ($log_contents =~ /captured plans:/g);
+is(scalar(@batches), 1, "one log entry per batch");
+
+unlike(
+	$log_contents,
+	qr/LOG:  duration:/,
+	"batched captures not logged one by one");
+
+# A flagged scan run by a function names the function in its plan, and is
+# accumulated per calling function.
+$node->safe_psql(
+	"postgres", q{
+CREATE FUNCTION scan_loop_items() RETURNS void
+	LANGUAGE plpgsql AS 'BEGIN PERFORM count(*) FROM loop_items; END';
+SELECT pg_plan_watch_reset();
+});
+$log_contents = query_log(
+	$node,
+	"SELECT scan_loop_items();",
+	{
+		"pg_plan_watch.log_seqscan_threshold" => "100",
+		"pg_plan_watch.log_nested_statements" => "on",
+		"pg_plan_watch.track_callers" => "on"
+	});
+
+like(
+	$log_contents,
+	qr/Calling Function: scan_loop_items\(\)/,
+	"calling function shown in the plan");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT funcid::regproc, relid::regclass, scans, rows_examined FROM pg_plan_watch_seqscan_callers;"
+	),
+	"scan_loop_items|loop_items|1|1000",
+	"flagged scan accumulated per calling function");
+
+# Each node of a sampled query keeps statistics across executions.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items; SELECT count(*) FROM loop_items;",
+	{
+		"compute_query_id" => "on",
+		"pg_plan_watch.sample_rate" => "1"
+	});
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT node, executions, mean_rows, mean_loops FROM pg_plan_watch_nodes WHERE node LIKE 'Seq Scan%';"
+	),
+	"Seq Scan on loop_items|2|1000|1",
+	"node statistics kept across executions");
+
+# A sampled query adds one folded stack per plan node, rooted at its query
+# identifier.
+$node->safe_psql("postgres", "SELECT pg_plan_watch_reset();");
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items;",
+	{ "pg_plan_watch.sample_rate" => "1" });
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT regexp_replace(stack, '^-?\\d+;', ''), samples FROM pg_plan_watch_folded_stacks() ORDER BY 1;"
+	),
+	"Aggregate|1\nAggregate;Seq Scan on loop_items|1",
+	"sampled plan folded into stacks");
+
+# Captures persisted by the background worker, and expired partitions
+# dropped by their bounds, whatever their names.
+$node->safe_psql("postgres",
+	"CREATE TABLE old_captures PARTITION OF pg_plan_watch_captures FOR VALUES FROM ('2000-01-01') TO ('2000-01-02');"
+);
+$node->append_conf(
+	'postgresql.conf', qq{
+pg_plan_watch.persist_database = 'postgres'
+pg_plan_watch.persist_naptime = 100
+});
+$node->restart;
+
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items;",
+	{ "pg_plan_watch.log_seqscan_threshold" => "100" });
+
+ok( $node->poll_query_until(
+		"postgres",
+		"SELECT count(*) > 0 FROM pg_plan_watch_captures WHERE plan LIKE '%Seq Scan on loop_items%';"
+	),
+	"capture persisted by the worker");
+
+ok( $node->poll_query_until(
+		"postgres",
+		"SELECT NOT EXISTS (SELECT FROM pg_class WHERE relname = 'old_captures');"
+	),
+	"expired partition dropped");
+
+is( $node->safe_psql(
+		"postgres",
+		"SELECT count(*) FROM pg_inherits WHERE inhparent = 'pg_plan_watch_captures'::regclass;"
+	),
+	"1",
+	"partition of today kept");
+
+# A captured plan read from the capture file by the documented protocol: the
+# slot of record N holds N before and after the record is read.
+$node->append_conf(
+	'postgresql.conf', qq{
+pg_plan_watch.capture_file = 'plan_watch.ring'
+pg_plan_watch.capture_file_slots = 16
+});
+$node->restart;
+
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items;",
+	{ "pg_plan_watch.log_seqscan_threshold" => "100" });
+
+open(my $ring, '<:raw', $node->data_dir . '/plan_watch.ring')
+  or die "could not open capture file: $!";
+sysread($ring, my $ring_header, 40) == 40
+  or die "could not read capture file header: $!";
+my ($magic, $version, $header_size, $slot_size, $nslots, $next_seq) =
+  unpack('a8 L L L L Q', $ring_header);
+
+is($magic, "PWSRING\0", "capture file magic");
+is($nslots, 16, "capture file slots");
+
+my $seq = $next_seq - 1;
+my $read_slot = sub {
+	my $slot;
+	sysseek($ring, $header_size + ($seq % $nslots) * $slot_size, 0);
+	sysread($ring, $slot, $slot_size);
+	return $slot;
+};
+my $slot = $read_slot->();
+my ($seq_before, $captured_at, $queryid, $duration, $dbid, $userid,
+	$plan_len) = unpack('Q q q d L L L', $slot);
+my $ring_plan = substr($slot, 48, $plan_len);
+my ($seq_after) = unpack('Q', $read_slot->());
+close($ring);
+
+is($seq_before, $seq, "slot holds the last record before reading");
+is($seq_after, $seq, "slot still holds it after reading");
+like($ring_plan, qr/Seq Scan on loop_items/, "captured plan read from the ring");
+is( $dbid,
+	$node->safe_psql(
+		"postgres", "SELECT oid FROM pg_database WHERE datname = 'postgres';"),
+	"record carries the database");
+is( $node->safe_psql(
+		"postgres", "SELECT next_seq FROM pg_plan_watch_capture_file();"),
+	$next_seq,
+	"next_seq reported by pg_plan_watch_capture_file");
+
+# Persisted captures and node statistics exported to a columnar file.
+query_log(
+	$node,
+	"SELECT count(*) FROM loop_items;",
+	{
+		"compute_query_id" => "on",
+		"pg_plan_watch.sample_rate" => "1"
+	});
+
+my $export = $node->data_dir . '/export.pwscol';
+is( $node->safe_psql(
+		"postgres",
+		"SELECT captures > 0, nodes > 0 AND nodes = (SELECT count(*) FROM pg_plan_watch_node_stats()) FROM pg_plan_watch_export_columnar('$export', '-infinity', 'infinity');"
+	),
+	"t|t",
+	"captures and node statistics exported");
+
+open(my $col, '<:raw', $export) or die "could not open export: $!";
+sysread($col, my $col_header, 22) == 22
+  or die "could not read export header: $!";
+close($col);
+my ($col_magic, $ntables, $first_table) = unpack('a8 N n/a', $col_header);
+
+is($col_magic, "PWSCOL\0\1", "export magic");
+is($ntables, 2, "export tables");
+is($first_table, "captures", "captures exported first");
+
+$node->stop('fast');
+
+done_testing();